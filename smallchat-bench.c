@@ -0,0 +1,451 @@
+/* smallchat-bench.c -- Connection scale benchmark for smallchat.
+ *
+ * Opens N idle connections against a local smallchat server and reports:
+ *
+ *   - How fast the server accepts clients (connections per second).
+ *   - Time-to-welcome latency percentiles: from connect() to the first
+ *     line the server sends to the new client.
+ *   - Server RSS per connection, from /proc/<pid>/status.
+ *   - The CPU cost of one event loop iteration while all the clients are
+ *     idle, from the server /stats command.
+ *
+ * A single source address only has ~28k ephemeral ports towards the same
+ * server port, so connections are spread among many source addresses of
+ * 127.0.0.0/8 (127.0.0.1, 127.0.0.2, ...), all of them reaching the server
+ * listening on 127.0.0.1.
+ *
+ * Usage: smallchat-bench [-n conns] [-c concurrency] [-a addresses]
+ *                        [-p port] [-i idle-seconds]
+ *                        [-s server-binary | -P server-pid]
+ *
+ * With -s the benchmark starts the server itself, otherwise pass its pid
+ * with -P to get the RSS figures. This program is Linux specific.
+ *
+ * Copyright (c) 2023, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
+
+/* State of every benchmark connection. */
+#define CONN_CONNECTING 0 // Waiting for the welcome line.
+#define CONN_IDLE 1       // Welcome received, the connection is idle.
+#define CONN_FAILED 2     // Refused, reset or closed by the server.
+
+struct conn
+{
+    int fd;
+    int state;
+    double start;    // When connect() was called, in seconds.
+    double welcome;  // Time-to-welcome, in seconds.
+};
+
+struct benchConfig
+{
+    int numconns;      // Connections to open.
+    int concurrency;   // Max connections waiting for the welcome at once.
+    int numaddrs;      // Source addresses to use, 127.0.0.1 and up.
+    int port;          // Server port.
+    int idletime;      // Seconds to measure the idle loop cost.
+    char *server;      // Server binary to start, or NULL.
+    pid_t serverpid;   // Server pid, or 0 if unknown.
+};
+
+struct benchConfig Config = {10000, 1000, 64, 7711, 5, NULL, 0};
+
+/* Current time in seconds, from the monotonic clock. */
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Return the resident set size of 'pid' in kilobytes, or -1. */
+long processRss(pid_t pid)
+{
+    char path[64], line[256];
+    long rss = -1;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (strncmp(line, "VmRSS:", 6) == 0)
+        {
+            rss = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return rss;
+}
+
+/* Start a non blocking connection to the server from the source address
+ * 127.0.0.<1+(id % numaddrs)>, spilling into 127.0.1.x and so forth when
+ * more than 254 addresses are requested. Return the socket or -1. */
+int startConnection(int id)
+{
+    int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (s == -1)
+        return -1;
+
+    /* Let the kernel pick the source port at connect() time, so that the
+     * same port can be reused with different destinations. */
+    int yes = 1;
+    setsockopt(s, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof(yes));
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    int addr = id % Config.numaddrs;
+    sa.sin_addr.s_addr = htonl((127U << 24) | ((addr / 254) << 8) |
+                               (addr % 254 + 1));
+    if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+    {
+        close(s);
+        return -1;
+    }
+
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(Config.port);
+    if (connect(s, (struct sockaddr *)&sa, sizeof(sa)) == -1 &&
+        errno != EINPROGRESS)
+    {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/* Send a command on a blocking connection and return the first line of
+ * the reply in 'buf', skipping lines that don't start with 'prefix'. */
+int sendCommand(int fd, const char *cmd, const char *prefix,
+                char *buf, size_t buflen)
+{
+    if (write(fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd))
+        return -1;
+    size_t used = 0;
+    while (1)
+    {
+        ssize_t nread = read(fd, buf + used, buflen - used - 1);
+        if (nread <= 0)
+            return -1;
+        used += nread;
+        buf[used] = 0;
+        char *line = buf, *nl;
+        while ((nl = strchr(line, '\n')) != NULL)
+        {
+            if (strncmp(line, prefix, strlen(prefix)) == 0)
+            {
+                *nl = 0;
+                memmove(buf, line, nl - line + 1);
+                return 0;
+            }
+            line = nl + 1;
+        }
+        memmove(buf, line, strlen(line) + 1);
+        used = strlen(buf);
+        if (used == buflen - 1)
+            used = 0; // Discard a too long line.
+    }
+}
+
+/* Parse the counters of the /stats reply. */
+int readStats(int fd, unsigned long long *loops, unsigned long long *cpu)
+{
+    char buf[4096];
+    if (sendCommand(fd, "/stats\n", "clients:", buf, sizeof(buf)) == -1)
+        return -1;
+    char *p = strstr(buf, "loops:");
+    char *q = strstr(buf, "loop_cpu_usec:");
+    if (p == NULL || q == NULL)
+        return -1;
+    *loops = strtoull(p + 6, NULL, 10);
+    *cpu = strtoull(q + 14, NULL, 10);
+    return 0;
+}
+
+/* Return 1 if something accepts connections on the server port. */
+int serverIsUp(void)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(Config.port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int ok = connect(s, (struct sockaddr *)&sa, sizeof(sa)) == 0;
+    close(s);
+    return ok;
+}
+
+/* Start the server binary and wait until it accepts connections. */
+void startServer(void)
+{
+    if (serverIsUp())
+    {
+        fprintf(stderr, "Port %d is already in use\n", Config.port);
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO); // The server logs every connection.
+        char maxclients[32];
+        snprintf(maxclients, sizeof(maxclients), "%d", Config.numconns);
+        execl(Config.server, Config.server, "--max-clients", maxclients,
+              (char *)NULL);
+        perror("exec");
+        _exit(1);
+    }
+    Config.serverpid = pid;
+
+    for (int j = 0; j < 100; j++)
+    {
+        if (serverIsUp())
+            return;
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            break; // The server exited.
+        usleep(50000);
+    }
+    fprintf(stderr, "The server did not start\n");
+    exit(1);
+}
+
+int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+void usage(void)
+{
+    fprintf(stderr,
+        "Usage: smallchat-bench [-n conns] [-c concurrency] [-a addresses]\n"
+        "                       [-p port] [-i idle-seconds]\n"
+        "                       [-s server-binary | -P server-pid]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:a:p:i:s:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n': Config.numconns = atoi(optarg); break;
+        case 'c': Config.concurrency = atoi(optarg); break;
+        case 'a': Config.numaddrs = atoi(optarg); break;
+        case 'p': Config.port = atoi(optarg); break;
+        case 'i': Config.idletime = atoi(optarg); break;
+        case 's': Config.server = optarg; break;
+        case 'P': Config.serverpid = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (Config.numconns <= 0 || Config.concurrency <= 0 ||
+        Config.numaddrs <= 0 || Config.numaddrs > 254 * 256)
+        usage();
+
+    /* We need one descriptor per connection, and so does the server if we
+     * start it: children inherit the limit. */
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rlim_t wanted = Config.numconns + 64;
+    if (rl.rlim_cur < wanted)
+    {
+        rl.rlim_cur = wanted < rl.rlim_max ? wanted : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < wanted)
+            fprintf(stderr, "Warning: open files limit is %lu, "
+                    "not enough for %d connections\n",
+                    (unsigned long)rl.rlim_cur, Config.numconns);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (Config.server)
+        startServer();
+    long rss_before = Config.serverpid ? processRss(Config.serverpid) : -1;
+
+    /* Connection phase: keep up to 'concurrency' connections waiting for
+     * their welcome line, and start a new one every time one completes. */
+    struct conn *conns = calloc(Config.numconns, sizeof(*conns));
+    struct epoll_event *events = calloc(1024, sizeof(*events));
+    int ep = epoll_create1(0);
+    int started = 0, inflight = 0, idle = 0, failed = 0;
+    double phase_start = now();
+
+    while (started < Config.numconns || inflight)
+    {
+        while (started < Config.numconns && inflight < Config.concurrency)
+        {
+            struct conn *c = conns + started;
+            c->start = now();
+            c->fd = startConnection(started);
+            if (c->fd == -1)
+            {
+                c->state = CONN_FAILED;
+                failed++;
+            }
+            else
+            {
+                struct epoll_event ev = {.events = EPOLLIN,
+                                         .data.u32 = started};
+                epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+                inflight++;
+            }
+            started++;
+        }
+
+        int numevents = epoll_wait(ep, events, 1024, 5000);
+        if (numevents == 0)
+        {
+            fprintf(stderr, "Timeout waiting for welcome messages, "
+                    "%d connections still pending\n", inflight);
+            break;
+        }
+        for (int j = 0; j < numevents; j++)
+        {
+            struct conn *c = conns + events[j].data.u32;
+            char buf[1024];
+            ssize_t nread = read(c->fd, buf, sizeof(buf));
+            if (nread > 0 && memchr(buf, '\n', nread) == NULL)
+                continue; // Partial welcome line.
+            epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+            inflight--;
+            if (nread > 0)
+            {
+                c->state = CONN_IDLE;
+                c->welcome = now() - c->start;
+                idle++;
+            }
+            else
+            {
+                c->state = CONN_FAILED;
+                close(c->fd);
+                failed++;
+            }
+        }
+    }
+    double elapsed = now() - phase_start;
+
+    /* Latency percentiles of the connections that got the welcome. */
+    double *lat = malloc(sizeof(double) * (idle ? idle : 1));
+    int numlat = 0;
+    for (int j = 0; j < Config.numconns; j++)
+        if (conns[j].state == CONN_IDLE)
+            lat[numlat++] = conns[j].welcome;
+    qsort(lat, numlat, sizeof(double), compareDouble);
+
+    printf("Connections:        %d requested, %d established, %d failed\n",
+           Config.numconns, idle, failed);
+    printf("Source addresses:   %d\n", Config.numaddrs);
+    printf("Accept throughput:  %.0f connections/sec (%.3f sec total)\n",
+           idle / elapsed, elapsed);
+    if (numlat)
+    {
+        printf("Time to welcome:    p50 %.3f ms, p90 %.3f ms, "
+               "p99 %.3f ms, max %.3f ms\n",
+               lat[numlat / 2] * 1000, lat[numlat * 90 / 100] * 1000,
+               lat[numlat * 99 / 100] * 1000, lat[numlat - 1] * 1000);
+    }
+
+    /* Give the server a moment to settle, then look at its memory. */
+    sleep(1);
+    if (rss_before != -1 && idle)
+    {
+        long rss_after = processRss(Config.serverpid);
+        printf("Server RSS:         %ld kB before, %ld kB after, "
+               "%.0f bytes per connection\n", rss_before, rss_after,
+               (rss_after - rss_before) * 1024.0 / idle);
+    }
+
+    /* Idle loop cost: sample the server counters over a period where
+     * nobody but us talks. */
+    int probe = -1;
+    for (int j = 0; j < Config.numconns && probe == -1; j++)
+        if (conns[j].state == CONN_IDLE)
+            probe = conns[j].fd;
+    if (probe != -1)
+    {
+        unsigned long long loops1, cpu1, loops2, cpu2;
+        fcntl(probe, F_SETFL, fcntl(probe, F_GETFL) & ~O_NONBLOCK);
+        if (readStats(probe, &loops1, &cpu1) == 0)
+        {
+            sleep(Config.idletime);
+            if (readStats(probe, &loops2, &cpu2) == 0 && loops2 > loops1)
+            {
+                printf("Idle loop cost:     %.1f usec CPU per iteration, "
+                       "%.1f iterations/sec\n",
+                       (double)(cpu2 - cpu1) / (loops2 - loops1),
+                       (double)(loops2 - loops1) / Config.idletime);
+            }
+        }
+        else
+        {
+            printf("Idle loop cost:     not available (no /stats reply)\n");
+        }
+    }
+
+    for (int j = 0; j < Config.numconns; j++)
+        if (conns[j].state == CONN_IDLE)
+            close(conns[j].fd);
+    if (Config.server)
+    {
+        kill(Config.serverpid, SIGTERM);
+        waitpid(Config.serverpid, NULL, 0);
+    }
+    return 0;
+}
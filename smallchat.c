@@ -40,41 +40,215 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
-#include <sys/select.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <time.h>
 /* ============================ Data structures =================================
  * The minimal stuff we can afford to have. This example must be simple
  * even for people that don't know a lot of C.
  * =========================================================================== */
 
-#define MAX_CLIENTS 1000 // This is actually the higher file descriptor.
+#define DEFAULT_MAX_CLIENTS 10000 // Default of --max-clients.
+#define FD_RESERVE 256 // Descriptors not for clients: log segments and so on.
+#define MAX_ACCEPTS_PER_CALL 1000 // Connections accepted per loop iteration.
 #define MAX_NICK_LEN 32
 #define SERVER_PORT 7711
+#define SNAPSHOT_INTERVAL 300 // Default seconds between snapshots.
+#define DEFAULT_ROOM "lobby" // Room every client joins when connecting.
+#define MAX_ROOM_LEN 32
+#define HISTORY_MAX_MSGS 100       // Messages remembered for every room...
+#define HISTORY_MAX_BYTES (64*1024) // ...as long as they fit in this size.
+#define MAX_LINE_LEN 4096 // Longer lines are processed in pieces.
+#define READ_LEN_MIN 1024   // Initial and minimum size of a read().
+#define READ_LEN_MAX 16384  // Max size of a read(), reached on bursts.
+#define READ_BUDGET_LINES 64 // Lines and bytes processed for a client in
+#define READ_BUDGET_BYTES (16*1024) // one event loop iteration, at most.
+#define IDLE_BUFFER_TIME 10 // Seconds before compacting idle input buffers.
+#define CLIENT_OUTPUT_LIMIT (1024*1024) // Max bytes queued for a client.
+#define CLIENT_OUTPUT_SOFT_LIMIT (256*1024) // Tolerated for a while...
+#define CLIENT_OUTPUT_GRACE 10              // ...that is, these seconds.
+#define FLOW_HIGH_WATERMARK (32*1024*1024) // Queued output of all clients
+#define FLOW_LOW_WATERMARK (16*1024*1024)  // that pauses/resumes senders.
+#define FLOW_ROOM_HIGH_WATERMARK (8*1024*1024) // The same for the queued
+#define FLOW_ROOM_LOW_WATERMARK (4*1024*1024)  // output of room members.
+#define FLOW_NOISY_BYTES (64*1024) // Fan-out per second of a noisy sender.
+
+#define CLIENT_CLOSE_ASAP (1<<0) // Free the client before the next poll().
+#define CLIENT_RATE_LIMITED (1<<1) // Not read until it has tokens again.
+#define CLIENT_RATE_NOTIFIED (1<<2) // Told that its lines are dropped.
+#define CLIENT_FLOW_PAUSED (1<<3) // Not read until the backlog drains.
+#define CLIENT_READ_PAUSED (CLIENT_RATE_LIMITED|CLIENT_FLOW_PAUSED)
+
+/* A timer, armed to call 'proc' at a given time. See the "Timers" section
+ * for the details. */
+struct timer
+{
+    struct timer *prev, *next; // Other timers in the same slot.
+    struct timer **slot;       // Slot of the wheel, or NULL if not armed.
+    uint64_t when;             // Expire time, in ticks.
+    void (*proc)(struct timer *t);
+    void *privdata;
+};
+
+/* A token bucket. See the "Rate limiting" section. */
+struct tokenBucket
+{
+    int64_t tokens; // Thousandths of token available, negative if in debt.
+    int64_t last;   // Clock.mstime of the last refill.
+};
+
+/* A buffer made of a chain of chunks. See the "Chunked buffers" section
+ * for the details. */
+struct chunkBuf
+{
+    struct bufNode *head, *tail;
+    size_t len;               // Total bytes in the buffer.
+    size_t filelen;           // Part of 'len' referencing files.
+    struct bufNode *readnode; // Where cbufCommitRead() starts filling.
+};
 
 /* This structure represents a connected client. There is very little
- * info about it: the socket descriptor and the nick name, if set, otherwise
- * the first byte of the nickname is set to 0 if not set.
- * The client can set its nickname with /nick <nickname> command. */
+ * info about it: the socket descriptor and the nick name. Every client
+ * has a nick: at connection time it is "user:<fd>", then the client can
+ * set its nickname with /nick <nickname> command. */
 struct client
 {
     int fd;     // Client socket.
-    char *nick; // Nickname of the client.
-    char *readbuf;   // Dynamic buffer for partial reads.
-    size_t buflen;   // Length of the buffer.
-    size_t bufused;  // How much of the buffer is used.
+    int nick;   // Nickname of the client, as an interned string id.
+    int flags;  // CLIENT_* flags.
+    struct chunkBuf inbuf; // Input not processed yet (partial lines).
+    struct chunkBuf outq;  // Output the socket did not accept yet.
+    struct historyQuery *query; // /history being streamed, or NULL.
+    struct chunkBuf held;  // Output queued while 'query' is streamed.
+    struct searchJob *search; // /search running in background, or NULL.
+    size_t readlen;        // How much we try to read next time.
+    time_t lastinput;      // Last time the client sent us something.
+    int room;              // Current room name id, or -1 if in no room.
+    int *rooms;            // Name ids of the joined rooms.
+    uint64_t *seen;        // For every room in 'rooms', the sequence number
+                           // of the last message the client received.
+    int numrooms;          // Length of the 'rooms' and 'seen' arrays.
+    struct session *session; // See the "Sessions" section.
+    struct ackWindow *acks;  // Unacknowledged DMs, NULL without /ack on.
+    struct timer idletimer;  // Idle input buffer, idle client timeout.
+    struct timer acktimer;   // Retransmission of unacknowledged DMs.
+    struct timer outputtimer; // Grace period over the soft output limit.
+    struct timer ratetimer;  // Reading again after exceeding a rate limit.
+    struct tokenBucket msgbucket;  // Lines per second.
+    struct tokenBucket bytebucket; // Bytes per second.
+    struct ipState *ip;      // Source address, see "Rate limiting".
+    size_t queued;           // Output memory counted in the backlogs.
+    uint64_t fanout;         // Bytes queued to others for its messages,
+    time_t fanouttime;       // halved every second since this time.
+};
+
+/* A set of clients, as a bitmap indexed by socket descriptor. See the
+ * "Client sets" section for the operations. */
+struct clientSet
+{
+    uint64_t *words; // Bit 'fd' is set if the client 'fd' is a member.
+    int numwords;    // Allocated words. Missing words are all zero.
+};
+
+/* A hash table with 64 bit keys. See the "Hash tables" section. */
+struct dict
+{
+    struct dictEntry **table; // Buckets, NULL until the first insertion.
+    size_t size;              // Number of buckets, a power of two.
+    size_t used;              // Number of entries.
+};
+
+/* A message in the history of a room: the message exactly as it was sent
+ * to the members, shared with their output queues, plus who sent it. */
+struct historyEntry
+{
+    struct chunk *msg;        // Formatted message, timestamp included.
+    int sender;               // Interned nick of the sender.
+    uint64_t seq;             // Sequence number in the room.
+};
+
+/* The last messages of a room, in a fixed capacity ring. */
+struct history
+{
+    struct historyEntry entries[HISTORY_MAX_MSGS];
+    int first;                // Index of the oldest entry.
+    int count;                // Number of entries.
+    size_t bytes;             // Total size of the messages.
+};
+
+/* A chat room. See the "Rooms" section. */
+struct room
+{
+    int name;                 // Interned name of the room.
+    struct clientSet members; // Clients that joined the room.
+    int nummembers;           // Number of members.
+    struct history history;   // Last messages sent to the room.
+    uint64_t seq;             // Sequence number of the last message.
+    size_t backlog;           // Output memory queued for the members.
+};
+
+/* Settings from the command line. */
+struct chatConfig
+{
+    int port;     // TCP port to listen on.
+    char *logdir; // Directory of the message log, or NULL to disable it.
+    int timeout;  // Seconds before idle clients are disconnected, 0 = never.
+    int timestampms; // Show milliseconds in the timestamps of messages.
+    int ratemsgs, ratebytes;     // Lines and bytes per second per client,
+    int ipratemsgs, ipratebytes; // and per source address. 0 = no limit.
+    int ratereject;  // Drop the lines over the limits instead of waiting.
+    int maxclients;  // Connections accepted at most, 0 = default...
+    int maxperip;    // ...and from the same address. 0 = no limit.
+    int shutdowntimeout; // Seconds to send queued output when stopping.
+    char *snapshot;  // File to save snapshots to, see "Snapshots".
+    int snapshotinterval; // Seconds between snapshots, 0 = on SIGUSR1 only.
+    int upgradefd;   // Socket to load the state from, see "Live upgrade".
 };
 
 /* This global structure encasulates the global state of the chat. */
 struct chatState
 {
     int serversock;                      // Listening server socket.
+    int sparefd;                         // Reserved for shedConnection().
     int numclients;                      // Number of connected clients right now.
-    int maxclient;                       // The greatest 'clients' slot populated.
-    struct client *clients[MAX_CLIENTS]; // Clients are set in the corresponding
-                                         // slot of their socket descriptor.
+    struct clientSet active;             // The set of connected clients.
+    struct clientSet pendingwrite;       // Clients with queued output.
+    struct clientSet querying;           // Clients with a /history query.
+    struct clientSet flowpaused;         // Clients paused by flow control.
+    struct clientSet pendingread;        // Clients over their read budget.
+    struct clientSet readable;           // Descriptors poll() reported as
+    struct clientSet writable;           // readable or writable.
+    struct pollfd *pollfds;              // Descriptors to poll, see main().
+    int numpollfds, pollcap;
+    int dispatchstart;                   // Client served first, see main().
+    size_t backlog;                      // Output memory queued, all clients.
+    struct dict rooms;                   // Room name id -> struct room.
+    struct dict ips;                     // Source address -> struct ipState.
+    struct timer crontimer;              // Calls serverCron().
+    unsigned long long stat_loops;       // Event loop iterations.
+    unsigned long long stat_loop_cpu_us; // CPU time spent in the loop.
+    unsigned long long stat_sendfile_bytes; // Sent from files to sockets.
+    unsigned long long stat_flow_pauses; // Senders paused by flow control.
+    unsigned long long stat_read_deferred; // Input left for the next loop.
+    unsigned long long stat_rejected;    // Connections refused, server full.
+    struct client **clients;             // Clients are set in the corresponding
+    int clientscap;                      // slot of their socket descriptor.
 };
 
 struct chatState *Chat; // Initialized at startup.
+struct chatConfig Config = {SERVER_PORT, NULL, 0, 0, 0, 0, 0, 0, 0,
+                            0, 0, 10, NULL, SNAPSHOT_INTERVAL, -1};
 
 /* ======================== Low level networking stuff ==========================
  * Here you will find basic socket stuff that should be part of
@@ -104,7 +278,8 @@ int createTCPServer(int port)
      sa -- the address to bind to
      sizeof(sa) -- the size of the address */
     if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) == -1 || 
-        listen(s, 511) == -1)
+        listen(s, 511) == -1 ||
+        fcntl(s, F_SETFL, O_NONBLOCK) == -1) // See MAX_ACCEPTS_PER_CALL.
     {
         close(s);
         return -1;
@@ -132,8 +307,8 @@ int socketSetNonBlockNoDelay(int fd)
 
 /* If the listening socket signaled there is a new connection ready to
  * be accepted, we accept(2) it and return -1 on error or the new client
- * socket on success. */
-int acceptClient(int server_socket)
+ * socket on success, setting '*addr' to the client IPv4 address. */
+int acceptClient(int server_socket, uint32_t *addr)
 {
     int s; // s is the client socket.
 
@@ -149,11 +324,24 @@ int acceptClient(int server_socket)
             else
                 return -1;
         }
+        *addr = ntohl(sa.sin_addr.s_addr);
         break;
     }
     return s;
 }
 
+/* Close every descriptor from 'lowfd' up, in a child that must not keep
+ * open what it inherited. Only system calls, so it is safe after fork(). */
+void closeFrom(int lowfd)
+{
+    if (syscall(SYS_close_range, lowfd, ~0U, 0) == -1)
+    {
+        int maxfd = getdtablesize();
+        for (int fd = lowfd; fd < maxfd; fd++)
+            close(fd);
+    }
+}
+
 /* We also define an allocator that always crashes on out of memory: you
  * will discover that in most programs designed to run for a long time, that
  * are not libraries, trying to recover from out of memory is often futile
@@ -180,314 +368,6838 @@ void *chatRealloc(void *ptr, size_t size)
     }
     return ptr;
 }
-/* desc : handle direct message
-sender -- the client who sent the DM
-target_nick -- the target client's name
-message -- the message to be sent*/
-void handleDirectMessage(struct client *sender, char *target_nick, char *message) {
-    // Check if the target user is found
-    for (int j = 0; j <= Chat->maxclient; j++) {
-        struct client *target = Chat->clients[j]; // Get the client
-        if (target && strcmp(target->nick, target_nick) == 0) { // Check if the client is found and the nick matches
-            // Construct the direct message
-            char dm[512]; // Make sure this is large enough
-            snprintf(dm, sizeof(dm), "DM from %s: %s", sender->nick, message);
-            // Send the DM to the target client only
-            write(target->fd, dm, strlen(dm));
-            return; // DM sent, return early
-        }
+
+/* ============================ Interned strings ================================
+ * Nicks and room names are stored exactly once in a global table, and the
+ * rest of the program refers to them by a small integer id. Two names are
+ * equal if and only if their ids are equal, so comparing nicks is just an
+ * integer compare, and anything that needs to remember a name (clients,
+ * history records, ...) can store the id instead of a copy of the string.
+ *
+ * Every entry also remembers its length and a 64 bit hash: the length saves
+ * strlen() calls when formatting messages, while the hash is a stable,
+ * process independent fingerprint of the name that can be used where ids
+ * can't, for example in data written on disk.
+ *
+ * Entries are reference counted: internGet() returns an id with one more
+ * reference, and internRelease() drops it. When the count reaches zero the
+ * string is freed and its id can be reused.
+ * =========================================================================== */
+
+#define INTERN_INITIAL_SIZE 256 // Must be a power of two.
+
+struct internEntry
+{
+    char *str;        // Null terminated string, or NULL if the id is free.
+    size_t len;       // Length of 'str'.
+    uint64_t hash;    // internHash() of the string.
+    int refcount;     // Number of references to this id.
+    int next;         // Next id in the same bucket or in the free list.
+};
+
+struct internTable
+{
+    struct internEntry *entries; // Entries, indexed by id.
+    int size;                    // Number of allocated entries.
+    int used;                    // Number of ids currently in use.
+    int freelist;                // First free id, or -1.
+    int *buckets;                // Heads of the chains, -1 if empty.
+    uint64_t mask;               // Number of buckets minus one.
+};
+
+struct internTable Intern; // Empty until the first internGet().
+
+/* FNV-1a: simple, good enough for short names, and stable across runs,
+ * which is what we want for hashes that may end up on disk. */
+uint64_t internHashString(const char *s, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t j = 0; j < len; j++)
+    {
+        h ^= (unsigned char)s[j];
+        h *= 1099511628211ULL;
     }
-    // If we reach here, the target user was not found
-    char *errmsg = "User not found\n";
-    write(sender->fd, errmsg, strlen(errmsg));
+    return h;
 }
 
+/* Grow the entries array and the buckets so that we keep roughly one
+ * entry per bucket. Chains are rebuilt from scratch. */
+void internResize(int newsize)
+{
+    int oldsize = Intern.size;
+    if (oldsize == 0)
+        Intern.freelist = -1;
+    Intern.entries = chatRealloc(Intern.entries,
+                                 sizeof(struct internEntry) * newsize);
+    Intern.buckets = chatRealloc(Intern.buckets, sizeof(int) * newsize);
+    Intern.size = newsize;
+    Intern.mask = newsize - 1;
 
-/* ====================== Small chat core implementation ========================
- * Here the idea is very simple: we accept new connections, read what clients
- * write us and fan-out (that is, send-to-all) the message to everybody
- * with the exception of the sender. And that is, of course, the most
- * simple chat system ever possible.
- * =========================================================================== */
+    /* New ids go in front of the free list. */
+    for (int id = newsize - 1; id >= oldsize; id--)
+    {
+        Intern.entries[id].str = NULL;
+        Intern.entries[id].refcount = 0;
+        Intern.entries[id].next = Intern.freelist;
+        Intern.freelist = id;
+    }
 
-/* Create a new client bound to 'fd'. This is called when a new client
- * connects. As a side effect updates the global Chat state. */
-struct client *createClient(int fd) {
-    char nick[32]; // Used to create an initial nick for the user.
-    int nicklen = snprintf(nick, sizeof(nick), "user:%d", fd);
-    struct client *c = chatMalloc(sizeof(*c));
-    socketSetNonBlockNoDelay(fd); // Pretend this will not fail.
-    c->fd = fd;
-    c->nick = chatMalloc(nicklen + 1); // +1 because of the null term.
-    c->readbuf = chatMalloc(256);      // Initial buffer size.
-    c->buflen = 256;
-    c->bufused = 0;
-    memcpy(c->nick, nick, nicklen);
-    assert(Chat->clients[c->fd] == NULL); // This should be available.
-    Chat->clients[c->fd] = c;
-    /* We need to update the max client set if needed. */
-    if ((c->fd) > (Chat->maxclient))
-        Chat->maxclient = c->fd;
-    Chat->numclients++;
-    return c;
+    for (int j = 0; j < newsize; j++)
+        Intern.buckets[j] = -1;
+    for (int id = 0; id < oldsize; id++)
+    {
+        struct internEntry *e = Intern.entries + id;
+        if (e->str == NULL)
+            continue;
+        int b = e->hash & Intern.mask;
+        e->next = Intern.buckets[b];
+        Intern.buckets[b] = id;
+    }
 }
 
-/* Free a client, associated resources, and unbind it from the global
- * state in Chat. */
-void freeClient(struct client *c)
+/* Return the id of the string 's' of length 'len' if it is already in the
+ * table, otherwise -1. The reference count is not touched. */
+int internLookup(const char *s, size_t len)
 {
-    free(c->nick);
-    close(c->fd);
-    Chat->clients[c->fd] = NULL;
-    Chat->numclients--;
-    if (Chat->maxclient == c->fd)
+    if (Intern.size == 0)
+        return -1;
+    uint64_t hash = internHashString(s, len);
+    int id = Intern.buckets[hash & Intern.mask];
+    while (id != -1)
     {
-        /* Ooops, this was the max client set. Let's find what is
-         * the new highest slot used. */
-        int j;
-        for (j = Chat->maxclient - 1; j >= 0; j--)
-        {
-            if (Chat->clients[j] != NULL)
-                Chat->maxclient = j;
-            break;
-        }
-        if (j == -1)
-            Chat->maxclient = -1; // We no longer have clients.
+        struct internEntry *e = Intern.entries + id;
+        if (e->hash == hash && e->len == len && memcmp(e->str, s, len) == 0)
+            return id;
+        id = e->next;
     }
-    free(c);
+    return -1;
 }
 
-/* Allocate and init the global stuff. */
-void initChat(void)
+/* Return the id of the string 's' of length 'len', adding it to the table
+ * if needed. The caller owns one reference to the returned id. */
+int internGet(const char *s, size_t len)
 {
-    Chat = chatMalloc(sizeof(*Chat));
-    memset(Chat, 0, sizeof(*Chat));
-    /* No clients at startup, of course. */
-    Chat->maxclient = -1;
-    Chat->numclients = 0;
-
-    /* Create our listening socket, bound to the given port. This
-     * is where our clients will connect. */
-    Chat->serversock = createTCPServer(SERVER_PORT);
-    if (Chat->serversock == -1)
+    int id = internLookup(s, len);
+    if (id != -1)
     {
-        perror("Creating listening socket");
-        exit(1);
+        Intern.entries[id].refcount++;
+        return id;
     }
+
+    if (Intern.size == 0 || Intern.freelist == -1)
+        internResize(Intern.size ? Intern.size * 2 : INTERN_INITIAL_SIZE);
+    id = Intern.freelist;
+    struct internEntry *e = Intern.entries + id;
+    Intern.freelist = e->next;
+
+    e->str = chatMalloc(len + 1);
+    memcpy(e->str, s, len);
+    e->str[len] = 0;
+    e->len = len;
+    e->hash = internHashString(s, len);
+    e->refcount = 1;
+    int b = e->hash & Intern.mask;
+    e->next = Intern.buckets[b];
+    Intern.buckets[b] = id;
+    Intern.used++;
+    return id;
 }
 
-/* Send the specified string to all connected clients but the one
- * having as socket descriptor 'excluded'. If you want to send something
- * to every client just set excluded to an impossible socket: -1. */
-void sendMsgToAllClientsBut(int excluded, char *s, size_t len)
-{
-    // get the current time
-    time_t rawtime;
-    struct tm *timeinfo;
-    char time_buffer[20]; // for hold the time string
-
-    time(&rawtime);                                                     //
-    timeinfo = localtime(&rawtime);                                     // convert to localtime
-    strftime(time_buffer, sizeof(time_buffer), "[%H:%M:%S]", timeinfo); // format the time
-
-    // construct the new message with the timestamp
-    char msg_with_time[256];
-    snprintf(msg_with_time, sizeof(msg_with_time), "%s %s", time_buffer, s);
-    len = strlen(msg_with_time);
-    for (int j = 0; j <= Chat->maxclient; j++)
-    {
-        if (Chat->clients[j] == NULL ||
-            Chat->clients[j]->fd == excluded)
-            continue;
+/* Add a reference to an id we already own. */
+void internRetain(int id)
+{
+    Intern.entries[id].refcount++;
+}
 
-        /* Important: we don't do ANY BUFFERING. We just use the kernel
-         * socket buffers. If the content does not fit, we don't care.
-         * This is needed in order to keep this program simple. */
-        write(Chat->clients[j]->fd, msg_with_time, len); // send the message to the client
-    }
+/* Drop a reference, freeing the string when nobody uses it anymore. */
+void internRelease(int id)
+{
+    struct internEntry *e = Intern.entries + id;
+    assert(e->refcount > 0);
+    if (--e->refcount > 0)
+        return;
+
+    /* Unlink from the bucket chain. */
+    int *link = &Intern.buckets[e->hash & Intern.mask];
+    while (*link != id)
+        link = &Intern.entries[*link].next;
+    *link = e->next;
+
+    free(e->str);
+    e->str = NULL;
+    e->next = Intern.freelist;
+    Intern.freelist = id;
+    Intern.used--;
 }
 
-/* The main() function implements the main chat logic:
- * 1. Accept new clients connections if any.
- * 2. Check if any client sent us some new message.
- * 3. Send the message to all the other clients. */
-int main(void)
+/* Accessors. The returned string is valid as long as the caller holds a
+ * reference to the id. */
+const char *internStr(int id) { return Intern.entries[id].str; }
+size_t internLen(int id) { return Intern.entries[id].len; }
+uint64_t internHash(int id) { return Intern.entries[id].hash; }
+
+/* =============================== Client sets ==================================
+ * Sets of clients are bitmaps with one bit per socket descriptor. Visiting
+ * the members costs one word test for every 64 slots plus a count trailing
+ * zeros instruction for every member, so even when, after a lot of churn,
+ * the few clients left are spread among many descriptors, scanning the set
+ * is almost free. Operations between sets (for instance "members of a room
+ * but not the sender") are plain loops on 64 bit words, simple enough that
+ * the compiler turns them into SIMD instructions.
+ *
+ * The typical iteration is:
+ *
+ *   for (int fd = setNext(set, 0); fd != -1; fd = setNext(set, fd + 1))
+ *
+ * It is safe to remove 'fd' from the set inside the loop.
+ * =========================================================================== */
+
+/* Make sure the set can hold the descriptor 'fd'. */
+void setReserve(struct clientSet *set, int fd)
 {
-    initChat();
+    int needed = fd / 64 + 1;
+    if (needed <= set->numwords)
+        return;
+    int newsize = set->numwords ? set->numwords : 1;
+    while (newsize < needed)
+        newsize *= 2;
+    set->words = chatRealloc(set->words, sizeof(uint64_t) * newsize);
+    memset(set->words + set->numwords, 0,
+           sizeof(uint64_t) * (newsize - set->numwords));
+    set->numwords = newsize;
+}
+
+void setAdd(struct clientSet *set, int fd)
+{
+    setReserve(set, fd);
+    set->words[fd / 64] |= 1ULL << (fd % 64);
+}
 
+void setDel(struct clientSet *set, int fd)
+{
+    if (fd / 64 < set->numwords)
+        set->words[fd / 64] &= ~(1ULL << (fd % 64));
+}
+
+int setHas(struct clientSet *set, int fd)
+{
+    if (fd < 0 || fd / 64 >= set->numwords)
+        return 0;
+    return (set->words[fd / 64] >> (fd % 64)) & 1;
+}
+
+/* Return the smallest member >= 'fd', or -1 if there is none. */
+int setNext(struct clientSet *set, int fd)
+{
+    int w = fd / 64;
+    if (w >= set->numwords)
+        return -1;
+    uint64_t word = set->words[w] & (~0ULL << (fd % 64));
     while (1)
     {
-        fd_set readfds;
-        struct timeval tv;
-        int retval;
+        if (word)
+            return w * 64 + __builtin_ctzll(word);
+        if (++w == set->numwords)
+            return -1;
+        word = set->words[w];
+    }
+}
 
-        FD_ZERO(&readfds);
-        /* When we want to be notified by select() that there is
-         * activity? If the listening socket has pending clients to accept
-         * or if any other client wrote anything. */
-        FD_SET(Chat->serversock, &readfds);
+/* Remove all the members. */
+void setClear(struct clientSet *set)
+{
+    if (set->numwords)
+        memset(set->words, 0, sizeof(uint64_t) * set->numwords);
+}
+
+/* Return the number of members. */
+int setCount(struct clientSet *set)
+{
+    int count = 0;
+    for (int w = 0; w < set->numwords; w++)
+        count += __builtin_popcountll(set->words[w]);
+    return count;
+}
+
+/* dst = a & ~b. 'dst' can be the same set as 'a'. */
+void setAndNot(struct clientSet *dst, struct clientSet *a, struct clientSet *b)
+{
+    if (a->numwords)
+        setReserve(dst, a->numwords * 64 - 1);
+    uint64_t *d = dst->words;
+    const uint64_t *x = a->words, *y = b->words;
+    int common = a->numwords < b->numwords ? a->numwords : b->numwords;
+    int j;
+    for (j = 0; j < common; j++)
+        d[j] = x[j] & ~y[j];
+    for (; j < a->numwords; j++)
+        d[j] = x[j];
+    for (; j < dst->numwords; j++)
+        d[j] = 0;
+}
+
+/* dst = a & b. 'dst' can be the same set as 'a'. */
+void setAnd(struct clientSet *dst, struct clientSet *a, struct clientSet *b)
+{
+    int common = a->numwords < b->numwords ? a->numwords : b->numwords;
+    if (common)
+        setReserve(dst, common * 64 - 1);
+    uint64_t *d = dst->words;
+    const uint64_t *x = a->words, *y = b->words;
+    int j;
+    for (j = 0; j < common; j++)
+        d[j] = x[j] & y[j];
+    for (; j < dst->numwords; j++)
+        d[j] = 0;
+}
+
+/* =============================== Hash tables ==================================
+ * A minimal hash table mapping 64 bit keys to pointers, used every time we
+ * need to find something by a key that is not a small dense integer: rooms
+ * by name, and so forth. String keys are first interned or hashed, so the
+ * table itself only deals with integers.
+ *
+ * Collisions are resolved by chaining, and the table doubles its size when
+ * it holds as many entries as buckets, so lookups are O(1) on average.
+ * =========================================================================== */
+
+#define DICT_INITIAL_SIZE 16 // Must be a power of two.
+
+struct dictEntry
+{
+    uint64_t key;
+    void *val;
+    struct dictEntry *next;
+};
+
+/* Keys are often small integers or already good hashes: mixing the bits
+ * (this is the splitmix64 finalizer) works well in both cases. */
+uint64_t dictHashKey(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
 
-        for (int j = 0; j <= Chat->maxclient; j++)
+void dictResize(struct dict *d, size_t newsize)
+{
+    struct dictEntry **newtable = chatMalloc(sizeof(*newtable) * newsize);
+    memset(newtable, 0, sizeof(*newtable) * newsize);
+    for (size_t j = 0; j < d->size; j++)
+    {
+        struct dictEntry *de = d->table[j];
+        while (de)
         {
-            if (Chat->clients[j])
-                FD_SET(j, &readfds); // FD_SET is a macro that sets the bit for the file descriptor j in the file descriptor set readfds. this add the client socket to the readfds set
+            struct dictEntry *next = de->next;
+            size_t b = dictHashKey(de->key) & (newsize - 1);
+            de->next = newtable[b];
+            newtable[b] = de;
+            de = next;
         }
+    }
+    free(d->table);
+    d->table = newtable;
+    d->size = newsize;
+}
+
+/* Return the value associated with 'key', or NULL if not found. */
+void *dictFind(struct dict *d, uint64_t key)
+{
+    if (d->size == 0)
+        return NULL;
+    struct dictEntry *de = d->table[dictHashKey(key) & (d->size - 1)];
+    while (de)
+    {
+        if (de->key == key)
+            return de->val;
+        de = de->next;
+    }
+    return NULL;
+}
 
-        /* Set a timeout for select(), see later why this may be useful
-         * in the future (not now). */
-        tv.tv_sec = 1; // 1 sec timeout
-        tv.tv_usec = 0;
+/* Associate 'val' to 'key'. The key must not already be in the table. */
+void dictAdd(struct dict *d, uint64_t key, void *val)
+{
+    if (d->used >= d->size)
+        dictResize(d, d->size ? d->size * 2 : DICT_INITIAL_SIZE);
+    struct dictEntry *de = chatMalloc(sizeof(*de));
+    size_t b = dictHashKey(key) & (d->size - 1);
+    de->key = key;
+    de->val = val;
+    de->next = d->table[b];
+    d->table[b] = de;
+    d->used++;
+}
 
-        /* Select wants as first argument the maximum file descriptor
-         * in use plus one. It can be either one of our clients or the
-         * server socket itself. */
-        int maxfd = Chat->maxclient;
-        if (maxfd < Chat->serversock)
-            maxfd = Chat->serversock;
-        retval = select(maxfd + 1, &readfds, NULL, NULL, &tv);
-        if (retval == -1)
+/* Remove 'key' from the table, returning its value, or NULL if the key
+ * was not found. */
+void *dictDelete(struct dict *d, uint64_t key)
+{
+    if (d->size == 0)
+        return NULL;
+    struct dictEntry **link = &d->table[dictHashKey(key) & (d->size - 1)];
+    while (*link)
+    {
+        struct dictEntry *de = *link;
+        if (de->key == key)
         {
-            perror("select() error");
-            exit(1);
+            void *val = de->val;
+            *link = de->next;
+            free(de);
+            d->used--;
+            return val;
         }
-        else if (retval)
+        link = &de->next;
+    }
+    return NULL;
+}
+
+/* Remove all the entries, calling 'fn' (if not NULL) for each of them
+ * first. The table can be reused after this call. */
+void dictEmpty(struct dict *d, void (*fn)(uint64_t key, void *val, void *privdata),
+               void *privdata)
+{
+    for (size_t j = 0; j < d->size; j++)
+    {
+        struct dictEntry *de = d->table[j];
+        while (de)
         {
+            struct dictEntry *next = de->next;
+            if (fn)
+                fn(de->key, de->val, privdata);
+            free(de);
+            de = next;
+        }
+    }
+    free(d->table);
+    d->table = NULL;
+    d->size = d->used = 0;
+}
 
-            /* If the listening socket is "readable", it actually means
-             * there are new clients connections pending to accept. */
-            if (FD_ISSET(Chat->serversock, &readfds)) // This is a macro that returns true if the bit for the file descriptor Chat->serversock is set in the file descriptor set readfds.
-            {
-                int fd = acceptClient(Chat->serversock);
-                struct client *c = createClient(fd);
-                /* Send a welcome message. */
-                char *welcome_msg =
-                    "Welcome to Simple Chat! "
-                    "Use /nick <nick> to set your nick.\n";
-                write(c->fd, welcome_msg, strlen(welcome_msg));
-                printf("Connected client fd=%d\n", fd);
-            }
+/* Call 'fn' for every entry of the table. The callback must not add or
+ * remove entries. */
+void dictForEach(struct dict *d, void (*fn)(uint64_t key, void *val, void *privdata),
+                 void *privdata)
+{
+    for (size_t j = 0; j < d->size; j++)
+        for (struct dictEntry *de = d->table[j]; de; de = de->next)
+            fn(de->key, de->val, privdata);
+}
 
-            /* Here for each connected client, check if there are pending
-             * data the client sent us. */
-            char readbuf[256];
-            for (int j = 0; j <= Chat->maxclient; j++)
-            {
-                if (Chat->clients[j] == NULL)
-                    continue;
-                if (FD_ISSET(j, &readfds)) // This is a macro that returns true if the bit for the file descriptor j is set in the file descriptor set readfds.
-                {
-                    /* Here we just hope that ther
-                     * message waiting for us. But it is entirely possible
-                     * that we read just half a message. In a normal program
-                     * that is not designed to be that simple, we should try
-                     * to buffer reads until the end-of-the-line is reached. */
-                    int nread = read(j, readbuf, sizeof(readbuf) - 1);
-                   
-                    if (nread <= 0)
-                    {
-                        /* Error or short read means that the socket
-                         * was closed. */
-                        printf("Disconnected client fd=%d, nick=%s\n",
-                               j, Chat->clients[j]->nick);
-                        freeClient(Chat->clients[j]);
-                    }
-                    else
-                    {
-                        /* The client sent us a message. We need to
-                         * relay this message to all the other clients
-                         * in the chat. */
-                        struct client *c = Chat->clients[j];
-                        readbuf[nread] = 0;
-
-                        /* If the user message starts with "/", we
-                         * process it as a client command. So far
-                         * only the /nick <newnick> command is implemented. */
-                        if (readbuf[0] == '/')
-                        {
-                            /* Remove any trailing newline. */
-                            char *p;
-                            p = strchr(readbuf, '\r');
-                            if (p)
-                                *p = 0;
-                            p = strchr(readbuf, '\n');
-                            if (p)
-                                *p = 0;
-                            /* Check for an argument of the command, after
-                             * the space. */
-                            char *arg = strchr(readbuf, ' ');
-                            if (arg)
-                            {
-                                *arg = 0; /* Terminate command name. */
-                                arg++;    /* Argument is 1 byte after the space. */
-                            }
-
-                            if (!strcmp(readbuf, "/nick") && arg)
-                            {
-                                free(c->nick); // Free old nick.
-                                int nicklen = strlen(arg); // New nick length.
-                                c->nick = chatMalloc(nicklen + 1); // Allocate new nick.
-                                memcpy(c->nick, arg, nicklen + 1); // Set new nick.
-                            }
-                            else if (!strcmp(readbuf, "/list"))
-                            {
-                                // list each client name 
-                                char userlist[256];
-                                char listmsg[256];
-                                memset(userlist, 0, sizeof(userlist));
-                                 for (int i = 0; i <= Chat->maxclient; i++) {
-                                    if (Chat->clients[i]) {
-                                        strcat(userlist, Chat->clients[i]->nick);
-                                        strcat(userlist, "\n");
-                                    }
-                                }
-                                write(c->fd, userlist, strlen(userlist)); // send the list to the client
-                                // send the number of connected users to the client 
-                                int msglen = snprintf(listmsg, sizeof(listmsg), "Number of connected users: %d\n", Chat->numclients);
-                                write(c->fd, listmsg, msglen);
-                            }
-                            else if (!strcmp(readbuf, "/dm"))
-                            {
-                                char *target_nick = strtok(arg, " "); // Get the first token after "/dm" as the target nickname
-                                char *message = strtok(NULL, ""); // Get the rest of the input as the message
-
-                                // Check if we got a target nickname and a message
-                                if (target_nick == NULL || message == NULL) {
-                                    printf("Error: The format is /dm <nickname> <message>\n");
-                                    continue; // Skip this iteration and wait for a new message
-                                }
-                                // Call a function to handle DM
-                                handleDirectMessage(c, target_nick, message);
-                            }
-                            else
-                            {
-                                /* Unsupported command. Send an error. */
-                                char *errmsg = "Unsupported command\n";
-                                write(c->fd, errmsg, strlen(errmsg));
-                            }
-                        }
-                        else
-                        {
-                            /* Create a message to send everybody (and show
-                             * on the server console) in the form:
-                             *   nick> some message. */
-                            char msg[256];
-                            int msglen = snprintf(msg, sizeof(msg),
-                                                  "%s> %s", c->nick, readbuf);
-                            printf("%s", msg);
-
-                            /* Send it to all the other clients. */
-                            sendMsgToAllClientsBut(j, msg, msglen);
-                        }
-                    }
-                }
-            }
+/* ============================ Chunked buffers =================================
+ * Client input and output is buffered in chains of chunks instead of a
+ * single region that we would need to realloc() to grow and memmove() to
+ * consume. A chunkBuf is a linked list of nodes, and every node references
+ * a range of bytes inside a chunk:
+ *
+ *   - Appending never moves existing data: when the last chunk is full we
+ *     just link a new one.
+ *   - Consuming from the front just advances the first node, and returns
+ *     the chunks we are done with to the pool.
+ *   - The buffer content can be passed to writev()/readv() as an array of
+ *     iovecs, one per node, without copying it.
+ *
+ * Chunks are reference counted, so the same chunk can be referenced by
+ * many buffers at once: a message sent to many clients is formatted once
+ * in its own chunk, and every recipient output buffer just references it.
+ *
+ * Chunks used for I/O come from two fixed size classes, 4k and 16k, that
+ * are recycled via free lists. Chunks holding a single shared message are
+ * allocated with the exact size of the message.
+ *
+ * A chunk can also stand for a file: the nodes referencing it are ranges
+ * of file offsets instead of memory. Output queues use them to send data
+ * that is already on disk, like the message log, with sendfile(). Such
+ * nodes are never passed to writev(), and are only found in buffers we
+ * write to sockets, never in the ones we read into.
+ * =========================================================================== */
+
+#define CHUNK_SMALL 0            // Class of 4k chunks.
+#define CHUNK_LARGE 1            // Class of 16k chunks.
+#define CHUNK_CLASSES 2
+#define CHUNK_UNPOOLED -1        // Exact size chunk, freed when unused.
+#define CHUNK_FILE -2            // A file, referenced by offset.
+#define CHUNKBUF_MAX_IOV 64      // Max iovecs we pass to writev() at once.
+
+static const size_t ChunkClassSize[CHUNK_CLASSES] = {4096, 16384};
+
+struct chunk
+{
+    int refcount;            // Number of nodes referencing the chunk.
+    int class;               // CHUNK_SMALL, CHUNK_LARGE, CHUNK_UNPOOLED
+                             // or CHUNK_FILE.
+    size_t size;             // Bytes available in 'data'.
+    union {
+        struct chunk *next;  // Next free chunk, when in the pool.
+        size_t used;         // Bytes of 'data' actually written.
+        int fd;              // The file of a CHUNK_FILE chunk.
+    } u;
+    char data[];
+};
+
+struct bufNode
+{
+    struct bufNode *next;
+    struct chunk *chunk;
+    size_t start, end;       // The node is the chunk data[start..end-1].
+};
+
+/* The pool of free chunks and nodes. */
+struct chunkPool
+{
+    struct chunk *free[CHUNK_CLASSES]; // Free lists of pooled chunks.
+    int numfree[CHUNK_CLASSES];        // Length of the free lists.
+    int allocated[CHUNK_CLASSES];      // Pooled chunks in use or free.
+    int minfree[CHUNK_CLASSES];        // Min 'numfree' since last trim.
+    struct bufNode *freenodes;         // Free list of nodes.
+};
+
+struct chunkPool ChunkPool;
+
+/* Get a chunk of the given class from the pool, allocating it if the
+ * free list is empty. The caller owns the only reference. */
+struct chunk *chunkAlloc(int class)
+{
+    struct chunk *ch = ChunkPool.free[class];
+    if (ch)
+    {
+        ChunkPool.free[class] = ch->u.next;
+        ChunkPool.numfree[class]--;
+        if (ChunkPool.numfree[class] < ChunkPool.minfree[class])
+            ChunkPool.minfree[class] = ChunkPool.numfree[class];
+    }
+    else
+    {
+        ch = chatMalloc(sizeof(*ch) + ChunkClassSize[class]);
+        ch->class = class;
+        ch->size = ChunkClassSize[class];
+        ChunkPool.allocated[class]++;
+    }
+    ch->refcount = 1;
+    ch->u.used = 0;
+    return ch;
+}
+
+/* Allocate an unpooled chunk able to hold exactly 'size' bytes. */
+struct chunk *chunkAllocSize(size_t size)
+{
+    struct chunk *ch = chatMalloc(sizeof(*ch) + size);
+    ch->class = CHUNK_UNPOOLED;
+    ch->size = size;
+    ch->refcount = 1;
+    ch->u.used = 0;
+    return ch;
+}
+
+/* Return a chunk standing for the file 'fd', with its own duplicate of
+ * the descriptor, closed when the chunk is released. Return NULL if the
+ * descriptor can't be duplicated. */
+struct chunk *chunkAllocFile(int fd)
+{
+    int dupfd = dup(fd);
+    if (dupfd == -1)
+        return NULL;
+    struct chunk *ch = chatMalloc(sizeof(*ch));
+    ch->class = CHUNK_FILE;
+    ch->size = 0;
+    ch->refcount = 1;
+    ch->u.fd = dupfd;
+    return ch;
+}
+
+void chunkRetain(struct chunk *ch)
+{
+    ch->refcount++;
+}
+
+/* Drop a reference: unused chunks go back to the pool, or are freed if
+ * they are not pooled. */
+void chunkRelease(struct chunk *ch)
+{
+    if (--ch->refcount > 0)
+        return;
+    if (ch->class < 0)
+    {
+        if (ch->class == CHUNK_FILE)
+            close(ch->u.fd);
+        free(ch);
+        return;
+    }
+    ch->u.next = ChunkPool.free[ch->class];
+    ChunkPool.free[ch->class] = ch;
+    ChunkPool.numfree[ch->class]++;
+}
+
+/* Link a new node referencing chunk[start..end-1] at the tail of the
+ * buffer. The buffer takes ownership of one reference to the chunk. */
+struct bufNode *cbufLink(struct chunkBuf *cb, struct chunk *ch,
+                         size_t start, size_t end)
+{
+    struct bufNode *n = ChunkPool.freenodes;
+    if (n)
+        ChunkPool.freenodes = n->next;
+    else
+        n = chatMalloc(sizeof(*n));
+    n->next = NULL;
+    n->chunk = ch;
+    n->start = start;
+    n->end = end;
+    if (cb->tail)
+        cb->tail->next = n;
+    else
+        cb->head = n;
+    cb->tail = n;
+    cb->len += end - start;
+    if (ch->class == CHUNK_FILE)
+        cb->filelen += end - start;
+    return n;
+}
+
+/* Unlink the first node, releasing its chunk. */
+void cbufUnlinkHead(struct chunkBuf *cb)
+{
+    struct bufNode *n = cb->head;
+    cb->head = n->next;
+    if (cb->head == NULL)
+        cb->tail = NULL;
+    cb->len -= n->end - n->start;
+    if (n->chunk->class == CHUNK_FILE)
+        cb->filelen -= n->end - n->start;
+    chunkRelease(n->chunk);
+    n->next = ChunkPool.freenodes;
+    ChunkPool.freenodes = n;
+}
+
+/* Return how many bytes can still be appended to the last chunk of the
+ * buffer without allocating. Only pooled chunks we are the sole owner of
+ * can be written: shared chunks are immutable. */
+size_t cbufTailRoom(struct chunkBuf *cb)
+{
+    struct bufNode *n = cb->tail;
+    if (n == NULL || n->chunk->class < 0 || n->chunk->refcount != 1)
+        return 0;
+    return n->chunk->size - n->end;
+}
+
+/* Append a copy of 'len' bytes at 'p'. */
+void cbufAppend(struct chunkBuf *cb, const char *p, size_t len)
+{
+    while (len)
+    {
+        size_t room = cbufTailRoom(cb);
+        if (room == 0)
+        {
+            int class = len > ChunkClassSize[CHUNK_SMALL] ?
+                        CHUNK_LARGE : CHUNK_SMALL;
+            cbufLink(cb, chunkAlloc(class), 0, 0);
+            room = cb->tail->chunk->size;
         }
-        else
+        size_t count = len < room ? len : room;
+        struct bufNode *n = cb->tail;
+        memcpy(n->chunk->data + n->end, p, count);
+        n->end += count;
+        n->chunk->u.used = n->end;
+        cb->len += count;
+        p += count;
+        len -= count;
+    }
+}
+
+/* Append a reference to 'len' bytes of the chunk 'ch' starting at offset
+ * 'start', without copying them. */
+void cbufAppendChunk(struct chunkBuf *cb, struct chunk *ch, size_t start,
+                     size_t len)
+{
+    chunkRetain(ch);
+    cbufLink(cb, ch, start, start + len);
+}
+
+/* Remove the first 'len' bytes from the buffer. */
+void cbufConsume(struct chunkBuf *cb, size_t len)
+{
+    assert(len <= cb->len);
+    while (len)
+    {
+        struct bufNode *n = cb->head;
+        size_t avail = n->end - n->start;
+        if (len < avail)
         {
-            /* Timeout occurred. We don't do anything right now, but in
-             * general this section can be used to wakeup periodically
-             * even if there is no clients activity. */
+            n->start += len;
+            cb->len -= len;
+            if (n->chunk->class == CHUNK_FILE)
+                cb->filelen -= len;
+            return;
         }
+        len -= avail;
+        cbufUnlinkHead(cb);
+    }
+}
+
+/* Move the content of 'src' at the end of 'dst', leaving 'src' empty. */
+void cbufJoin(struct chunkBuf *dst, struct chunkBuf *src)
+{
+    if (src->head == NULL)
+        return;
+    if (dst->tail)
+        dst->tail->next = src->head;
+    else
+        dst->head = src->head;
+    dst->tail = src->tail;
+    dst->len += src->len;
+    dst->filelen += src->filelen;
+    src->head = src->tail = NULL;
+    src->len = src->filelen = 0;
+}
+
+/* Release everything. The buffer can be reused after this call. */
+void cbufClear(struct chunkBuf *cb)
+{
+    while (cb->head)
+        cbufUnlinkHead(cb);
+}
+
+/* Fill up to 'maxiov' iovecs with the buffer content, for writev(),
+ * stopping at the first file node. Return the number of iovecs used. */
+int cbufIov(struct chunkBuf *cb, struct iovec *iov, int maxiov)
+{
+    int count = 0;
+    for (struct bufNode *n = cb->head; n && count < maxiov; n = n->next)
+    {
+        if (n->chunk->class == CHUNK_FILE)
+            break;
+        iov[count].iov_base = n->chunk->data + n->start;
+        iov[count].iov_len = n->end - n->start;
+        count++;
+    }
+    return count;
+}
+
+/* Prepare the buffer to receive at least 'want' bytes, and fill 'iov'
+ * with the free space for readv(): the room left in the last chunk, plus
+ * a new chunk if that room is less than 'want'. Return the number of
+ * iovecs, then call cbufCommitRead() with the number of bytes read. */
+int cbufPrepareRead(struct chunkBuf *cb, size_t want, struct iovec *iov)
+{
+    int count = 0;
+    size_t room = cbufTailRoom(cb);
+    cb->readnode = NULL;
+    if (room)
+    {
+        cb->readnode = cb->tail;
+        iov[count].iov_base = cb->tail->chunk->data + cb->tail->end;
+        iov[count].iov_len = room;
+        count++;
+    }
+    if (room < want)
+    {
+        int class = want - room > ChunkClassSize[CHUNK_SMALL] ?
+                    CHUNK_LARGE : CHUNK_SMALL;
+        struct bufNode *n = cbufLink(cb, chunkAlloc(class), 0, 0);
+        if (cb->readnode == NULL)
+            cb->readnode = n;
+        iov[count].iov_base = n->chunk->data;
+        iov[count].iov_len = n->chunk->size;
+        count++;
+    }
+    return count;
+}
+
+/* Account for 'len' bytes stored by readv() in the space returned by
+ * cbufPrepareRead(). If nothing landed in the new chunk, it is released. */
+void cbufCommitRead(struct chunkBuf *cb, size_t len)
+{
+    struct bufNode *n = cb->readnode;
+    cb->len += len;
+    while (1)
+    {
+        size_t count = n->chunk->size - n->end;
+        if (count > len) count = len;
+        n->end += count;
+        n->chunk->u.used = n->end;
+        len -= count;
+        if (n == cb->tail)
+            break;
+        n = n->next;
+    }
+
+    /* Drop the new chunk if nothing was read into it. This is rare, so
+     * walking the list to find the previous node is fine. */
+    if (n->start == n->end)
+    {
+        if (n == cb->head)
+        {
+            cbufUnlinkHead(cb);
+            return;
+        }
+        struct bufNode *prev = cb->head;
+        while (prev->next != n)
+            prev = prev->next;
+        prev->next = NULL;
+        cb->tail = prev;
+        chunkRelease(n->chunk);
+        n->next = ChunkPool.freenodes;
+        ChunkPool.freenodes = n;
+    }
+}
+
+/* Return the offset of the first occurrence of 'c' in the buffer, or -1
+ * if not found. */
+ssize_t cbufFind(struct chunkBuf *cb, char c)
+{
+    size_t offset = 0;
+    for (struct bufNode *n = cb->head; n; n = n->next)
+    {
+        char *p = memchr(n->chunk->data + n->start, c, n->end - n->start);
+        if (p)
+            return offset + (p - (n->chunk->data + n->start));
+        offset += n->end - n->start;
+    }
+    return -1;
+}
+
+/* Copy the first 'len' bytes of the buffer into 'dst' without consuming
+ * them. */
+void cbufPeek(struct chunkBuf *cb, char *dst, size_t len)
+{
+    for (struct bufNode *n = cb->head; n && len; n = n->next)
+    {
+        size_t count = n->end - n->start;
+        if (count > len) count = len;
+        memcpy(dst, n->chunk->data + n->start, count);
+        dst += count;
+        len -= count;
+    }
+}
+
+/* Give the memory of chunks nobody used for a while back to the system.
+ * Called periodically: the chunks that stayed in the free lists for the
+ * whole period since the previous call are not needed by the current
+ * load, so we free them. Bursts still find the pool warm, but after the
+ * burst is over the pool shrinks back. */
+void chunkPoolTrim(void)
+{
+    for (int class = 0; class < CHUNK_CLASSES; class++)
+    {
+        int excess = ChunkPool.minfree[class];
+        while (excess-- && ChunkPool.free[class])
+        {
+            struct chunk *ch = ChunkPool.free[class];
+            ChunkPool.free[class] = ch->u.next;
+            ChunkPool.numfree[class]--;
+            ChunkPool.allocated[class]--;
+            free(ch);
+        }
+        ChunkPool.minfree[class] = ChunkPool.numfree[class];
+    }
+}
+
+/* Move the content of the buffer into a single unpooled chunk of the
+ * exact size, releasing the pooled chunks it used. This is useful for
+ * buffers holding a few bytes for a long time: a partial line of an idle
+ * client should not pin a 4k chunk. */
+void cbufCompact(struct chunkBuf *cb)
+{
+    if (cb->len == 0 || (cb->head == cb->tail &&
+                         cb->head->chunk->class == CHUNK_UNPOOLED))
+        return;
+    struct chunk *ch = chunkAllocSize(cb->len);
+    cbufPeek(cb, ch->data, cb->len);
+    ch->u.used = cb->len;
+    cbufClear(cb);
+    cbufLink(cb, ch, 0, ch->u.used);
+}
+
+/* ============================ Background jobs =================================
+ * Everything that may block for an unpredictable amount of time, like
+ * fsync(), or that takes a lot of CPU, can't run in the event loop thread
+ * without stalling all the clients. Such jobs are handed to a small pool
+ * of threads instead.
+ *
+ * A job is a 'work' function called in a background thread, and an
+ * optional 'done' function called later in the event loop thread, with
+ * the same argument, once 'work' returned: this is where the results are
+ * used, since only the event loop thread is allowed to touch the chat
+ * state. Completed jobs are signaled to the event loop via a pipe, that
+ * poll() watches together with the sockets.
+ * =========================================================================== */
+
+#define BIO_THREADS 2
+
+struct bioJob
+{
+    void (*work)(void *arg);  // Called in a background thread.
+    void (*done)(void *arg);  // Called in the event loop thread, or NULL.
+    void *arg;
+    struct bioJob *next;
+};
+
+struct bioState
+{
+    pthread_mutex_t lock;
+    pthread_cond_t newjob;
+    struct bioJob *queue, *queuetail;  // Jobs waiting for a thread.
+    struct bioJob *completed;          // Jobs waiting for 'done'.
+    int pending;                       // Jobs submitted and not done,
+                                       // only used by the event loop.
+    int pipefd[2];                     // Wakes up the event loop.
+    pthread_t threads[BIO_THREADS];
+};
+
+struct bioState Bio;
+
+void *bioThreadMain(void *privdata)
+{
+    (void)privdata;
+    while (1)
+    {
+        pthread_mutex_lock(&Bio.lock);
+        while (Bio.queue == NULL)
+            pthread_cond_wait(&Bio.newjob, &Bio.lock);
+        struct bioJob *job = Bio.queue;
+        Bio.queue = job->next;
+        if (Bio.queue == NULL)
+            Bio.queuetail = NULL;
+        pthread_mutex_unlock(&Bio.lock);
+
+        job->work(job->arg);
+
+        pthread_mutex_lock(&Bio.lock);
+        job->next = Bio.completed;
+        Bio.completed = job;
+        pthread_mutex_unlock(&Bio.lock);
+        char byte = 0;
+        if (write(Bio.pipefd[1], &byte, 1) == -1)
+        {
+            /* The pipe is full: the event loop has a wakeup pending
+             * anyway, and it will collect all the completed jobs. */
+        }
+    }
+    return NULL;
+}
+
+/* Create the pipe and start the threads. */
+void bioInit(void)
+{
+    pthread_mutex_init(&Bio.lock, NULL);
+    pthread_cond_init(&Bio.newjob, NULL);
+    if (pipe(Bio.pipefd) == -1)
+    {
+        perror("Creating the background jobs pipe");
+        exit(1);
+    }
+    fcntl(Bio.pipefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(Bio.pipefd[1], F_SETFL, O_NONBLOCK);
+    /* Signals must interrupt the poll() of the event loop: the threads
+     * inherit a mask blocking all of them. */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int j = 0; j < BIO_THREADS; j++)
+    {
+        if (pthread_create(&Bio.threads[j], NULL, bioThreadMain, NULL) != 0)
+        {
+            fprintf(stderr, "Can't create background threads\n");
+            exit(1);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Queue a job for the background threads. */
+void bioSubmit(void (*work)(void *arg), void (*done)(void *arg), void *arg)
+{
+    struct bioJob *job = chatMalloc(sizeof(*job));
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+    job->next = NULL;
+    pthread_mutex_lock(&Bio.lock);
+    if (Bio.queuetail)
+        Bio.queuetail->next = job;
+    else
+        Bio.queue = job;
+    Bio.queuetail = job;
+    Bio.pending++;
+    pthread_cond_signal(&Bio.newjob);
+    pthread_mutex_unlock(&Bio.lock);
+}
+
+/* Called by the event loop when the pipe is readable: run the 'done'
+ * callbacks of the completed jobs, oldest first. */
+void bioProcessCompleted(void)
+{
+    char buf[256];
+    while (read(Bio.pipefd[0], buf, sizeof(buf)) > 0);
+
+    pthread_mutex_lock(&Bio.lock);
+    struct bioJob *list = Bio.completed;
+    Bio.completed = NULL;
+    pthread_mutex_unlock(&Bio.lock);
+
+    /* The list is newest first, reverse it. */
+    struct bioJob *ordered = NULL;
+    while (list)
+    {
+        struct bioJob *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+    while (ordered)
+    {
+        struct bioJob *job = ordered;
+        ordered = job->next;
+        if (job->done)
+            job->done(job->arg);
+        Bio.pending--;
+        free(job);
+    }
+}
+
+/* =================================== Clock ====================================
+ * The current time is needed all the time: to timestamp every message, to
+ * know when a client sent something, and so on. Instead of asking the
+ * kernel every time, the time is read once per event loop iteration, with
+ * the coarse clock that is cheap to read, and everything in the iteration
+ * uses the cached value: the work of a single iteration takes much less
+ * than the resolution of our timestamps anyway.
+ *
+ * Formatting the "[HH:MM:SS]" prefix of messages needs localtime(), that
+ * takes a lock and may even check if the time zone file changed: it is
+ * done at most once per second, and the prefix is reused in between. With
+ * --timestamp-ms the prefix is "[HH:MM:SS.mmm]", and only the milliseconds
+ * are formatted again when the second did not change.
+ * =========================================================================== */
+
+struct clockCache
+{
+    time_t unixtime;          // Unix time in seconds.
+    int64_t mstime;           // Unix time in milliseconds.
+    time_t stampsecond;       // Second 'stamp' was rendered for, or 0.
+    char stamp[32];           // Timestamp prefix of messages.
+    size_t stamplen;
+};
+
+struct clockCache Clock;
+
+/* Refresh the cached time. Called once per event loop iteration. */
+void clockUpdate(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    Clock.unixtime = ts.tv_sec;
+    Clock.mstime = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Return the timestamp prefix of messages sent now, setting '*len' to
+ * its length. */
+const char *clockTimestamp(size_t *len)
+{
+    if (Clock.stampsecond != Clock.unixtime)
+    {
+        struct tm tm;
+        localtime_r(&Clock.unixtime, &tm);
+        Clock.stamplen = strftime(Clock.stamp, sizeof(Clock.stamp),
+                                  Config.timestampms ? "[%H:%M:%S.000]"
+                                                     : "[%H:%M:%S]", &tm);
+        Clock.stampsecond = Clock.unixtime;
+    }
+    if (Config.timestampms)
+    {
+        /* Just the digits between the dot and the bracket. */
+        int ms = Clock.mstime % 1000;
+        char *p = Clock.stamp + Clock.stamplen - 4;
+        p[0] = '0' + ms / 100;
+        p[1] = '0' + ms / 10 % 10;
+        p[2] = '0' + ms % 10;
+    }
+    *len = Clock.stamplen;
+    return Clock.stamp;
+}
+
+/* ================================== Timers ====================================
+ * Things that must happen at a given time, like disconnecting a client idle
+ * for too long, are timers in a hierarchical timing wheel: TIMER_LEVELS
+ * wheels of TIMER_SLOTS slots each. A slot of the first wheel is a tick,
+ * TIMER_TICK milliseconds, a slot of the second wheel is a full turn of the
+ * first one, and so on. A timer goes in the slot of the smallest wheel that
+ * reaches its expire time, so both adding and removing a timer are O(1):
+ * slots are doubly linked lists.
+ *
+ * The event loop fires the timers in the current slot of the first wheel.
+ * When the time reaches a slot of an upper wheel, its timers are added
+ * again, now landing in the wheels below, down to the first one.
+ *
+ * Every wheel has a bitmap of its non empty slots, and every slot knows
+ * its earliest timer, so the next expire time is found with a few bit
+ * operations, and poll() sleeps exactly until then, or until a client
+ * needs us. Ticks where nothing happens are skipped.
+ *
+ * Timers are embedded in the structure they belong to, for instance the
+ * client, so arming a timer never allocates memory.
+ * =========================================================================== */
+
+#define TIMER_TICK 10       // Milliseconds per tick.
+#define TIMER_SLOTS_BITS 6  // Slots in every wheel, as a power of two.
+#define TIMER_SLOTS (1 << TIMER_SLOTS_BITS)
+#define TIMER_LEVELS 4      // Wheels. With 10ms ticks they cover 46 hours.
+
+struct timerWheel
+{
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t used[TIMER_LEVELS]; // Bit 's' set if the slot 's' is not empty.
+    uint64_t min[TIMER_LEVELS][TIMER_SLOTS]; // No timer of the slot expires
+                                             // before this tick.
+    uint64_t now;                // Last tick processed.
+    int count;                   // Armed timers.
+};
+
+struct timerWheel Timers;
+
+/* Current monotonic time in microseconds. */
+int64_t ustime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Current monotonic time in ticks. */
+uint64_t timerTick(void)
+{
+    return ustime() / 1000 / TIMER_TICK;
+}
+
+void timerInit(void)
+{
+    Timers.now = timerTick();
+}
+
+/* Initialize a timer that will call 'proc' with the timer itself, from
+ * where 'proc' can find 'privdata'. */
+void timerSetup(struct timer *t, void (*proc)(struct timer *t),
+                void *privdata)
+{
+    memset(t, 0, sizeof(*t));
+    t->proc = proc;
+    t->privdata = privdata;
+}
+
+int timerIsArmed(struct timer *t)
+{
+    return t->slot != NULL;
+}
+
+/* Put the timer in the wheel, in the slot of the smallest wheel where the
+ * expire tick and the current tick only differ by the slot index. Timers
+ * expiring after what the wheels cover go in the farthest slot, and are
+ * just added again when it is reached. */
+void timerLink(struct timer *t)
+{
+    uint64_t when = t->when;
+    uint64_t horizon = 1ULL << (TIMER_SLOTS_BITS * TIMER_LEVELS);
+    if (when - Timers.now >= horizon)
+        when = Timers.now + horizon - 1;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 &&
+           (when >> (TIMER_SLOTS_BITS * (level + 1))) !=
+           (Timers.now >> (TIMER_SLOTS_BITS * (level + 1))))
+        level++;
+    int slot = (when >> (TIMER_SLOTS_BITS * level)) & (TIMER_SLOTS - 1);
+
+    t->slot = &Timers.slots[level][slot];
+    t->prev = NULL;
+    t->next = *t->slot;
+    if (t->next)
+        t->next->prev = t;
+    *t->slot = t;
+    if (!(Timers.used[level] & (1ULL << slot)) ||
+        when < Timers.min[level][slot])
+        Timers.min[level][slot] = when;
+    Timers.used[level] |= 1ULL << slot;
+}
+
+/* Remove the timer from the wheel, if it is armed. */
+void timerCancel(struct timer *t)
+{
+    if (!timerIsArmed(t))
+        return;
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        *t->slot = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    if (*t->slot == NULL)
+    {
+        int level = (t->slot - &Timers.slots[0][0]) / TIMER_SLOTS;
+        int slot = (t->slot - &Timers.slots[0][0]) % TIMER_SLOTS;
+        Timers.used[level] &= ~(1ULL << slot);
+    }
+    t->slot = NULL;
+    Timers.count--;
+}
+
+/* Arm the timer to fire in 'ms' milliseconds, replacing the previous
+ * expire time if it was already armed. */
+void timerSet(struct timer *t, int64_t ms)
+{
+    timerCancel(t);
+    t->when = (ustime() / 1000 + ms) / TIMER_TICK;
+    if (t->when <= Timers.now)
+        t->when = Timers.now + 1; // The current tick was already processed.
+    timerLink(t);
+    Timers.count++;
+}
+
+/* Detach the list of timers of a slot from the wheel. */
+struct timer *timerTakeSlot(int level, int slot)
+{
+    struct timer *list = Timers.slots[level][slot];
+    Timers.slots[level][slot] = NULL;
+    Timers.used[level] &= ~(1ULL << slot);
+    return list;
+}
+
+/* The first tick, after the current one, at which a timer may expire.
+ * Zero if there are no timers.
+ *
+ * For the first wheel this is exact. For the others the first non empty
+ * slot is enough: its timers expire before the ones of the next slots.
+ * The slot minimum is not updated when timers are cancelled, so we may
+ * wake up for nothing, but never too late. */
+uint64_t timerNextTick(void)
+{
+    uint64_t next = 0;
+    for (int level = 0; level < TIMER_LEVELS; level++)
+    {
+        if (Timers.used[level] == 0)
+            continue;
+        int shift = TIMER_SLOTS_BITS * level;
+        uint64_t current = (Timers.now >> shift) & (TIMER_SLOTS - 1);
+        /* Slots after the current one come first, then the others, on
+         * the next turn. The current slot itself is always empty. */
+        uint64_t after = Timers.used[level] & ~((2ULL << current) - 1);
+        uint64_t turn = (Timers.now >> shift >> TIMER_SLOTS_BITS)
+                        << TIMER_SLOTS_BITS;
+        if (after == 0)
+            turn += TIMER_SLOTS;
+        int slot = __builtin_ctzll(after ? after : Timers.used[level]);
+        uint64_t tick = (turn + slot) << shift;
+        if (level && Timers.min[level][slot] > tick)
+            tick = Timers.min[level][slot];
+        if (next == 0 || tick < next)
+            next = tick;
+    }
+    return next;
+}
+
+/* Set the current tick, moving the timers of the upper wheels whose slot
+ * is now the current one down to the wheels below, from the top, since a
+ * timer can move down more than a level. Timers expiring right now land
+ * in the current slot of the first wheel. */
+void timerAdvance(uint64_t tick)
+{
+    Timers.now = tick;
+    for (int level = TIMER_LEVELS - 1; level > 0; level--)
+    {
+        int slot = (tick >> (TIMER_SLOTS_BITS * level)) & (TIMER_SLOTS - 1);
+        if (!(Timers.used[level] & (1ULL << slot)))
+            continue;
+        struct timer *t = timerTakeSlot(level, slot);
+        while (t)
+        {
+            struct timer *next = t->next;
+            timerLink(t);
+            t = next;
+        }
+    }
+}
+
+/* Milliseconds until timerProcess() has something to do, or -1 if there
+ * are no timers. */
+int64_t timerNextTimeout(void)
+{
+    uint64_t next = timerNextTick();
+    if (next == 0)
+        return -1;
+    /* Rounded up: waking up before the tick starts is useless. */
+    int64_t us = (int64_t)(next * TIMER_TICK) * 1000 - ustime();
+    return us > 0 ? (us + 999) / 1000 : 0;
+}
+
+/* Advance the wheels up to the current time, firing the expired timers.
+ * Ticks where nothing happens are skipped. */
+void timerProcess(void)
+{
+    uint64_t target = timerTick();
+    while (Timers.now < target)
+    {
+        uint64_t next = timerNextTick();
+        if (next == 0 || next > target)
+        {
+            timerAdvance(target);
+            break;
+        }
+        timerAdvance(next);
+
+        /* Fire the timers of the current tick. They are detached from the
+         * wheel before calling them, so that they can arm themselves
+         * again, or cancel other timers of the same slot. */
+        int slot = Timers.now & (TIMER_SLOTS - 1);
+        while (Timers.slots[0][slot])
+        {
+            struct timer *t = Timers.slots[0][slot];
+            timerCancel(t);
+            t->proc(t);
+        }
+    }
+}
+
+/* =============================== Rate limiting ================================
+ * Every client, and every source address, has two token buckets: one for
+ * the lines it sends per second, one for the bytes. A bucket holds up to
+ * a second worth of tokens, so short bursts are fine, and every line takes
+ * a token from the line buckets and a token per byte from the byte ones.
+ *
+ * Buckets are not refilled by timers: when a line arrives, the tokens
+ * accumulated since the last refill are added, using the cached clock.
+ * Clients that respect the limits cost just this computation.
+ *
+ * When a line exceeds a limit, by default it is delayed: we stop reading
+ * the socket of the client until there are enough tokens, and its TCP
+ * window fills up, so the spammer slows down and nobody else notices.
+ * With --rate-reject the line is dropped instead.
+ * =========================================================================== */
+
+/* State of a source address, shared by all its clients. */
+struct ipState
+{
+    uint32_t addr;                  // IPv4 address, host byte order.
+    int clients;                    // Clients connected from here.
+    struct tokenBucket msgbucket;   // Lines per second.
+    struct tokenBucket bytebucket;  // Bytes per second.
+};
+
+/* Add the tokens that accumulated since the last refill to a bucket
+ * filling at 'rate' tokens per second. Tokens are kept in thousandths, so
+ * that even a millisecond adds something. A zeroed bucket is full. */
+void bucketRefill(struct tokenBucket *b, int rate)
+{
+    int64_t elapsed = Clock.mstime - b->last;
+    b->last = Clock.mstime;
+    if (elapsed > 1000)
+        elapsed = 1000; // A second fills the bucket anyway.
+    if (elapsed > 0)
+        b->tokens += elapsed * rate;
+    if (b->tokens > (int64_t)rate * 1000)
+        b->tokens = (int64_t)rate * 1000;
+}
+
+/* Milliseconds until the bucket has 'need' tokens, 0 if it has them. */
+int64_t bucketWait(struct tokenBucket *b, int rate, int64_t need)
+{
+    int64_t missing = need * 1000 - b->tokens;
+    return missing > 0 ? (missing + rate - 1) / rate : 0;
+}
+
+/* Return the state of the source address 'addr', creating it if needed,
+ * with one more client. */
+struct ipState *ipAttach(uint32_t addr)
+{
+    struct ipState *ip = dictFind(&Chat->ips, addr);
+    if (ip == NULL)
+    {
+        ip = chatMalloc(sizeof(*ip));
+        memset(ip, 0, sizeof(*ip));
+        ip->addr = addr;
+        dictAdd(&Chat->ips, addr, ip);
+    }
+    ip->clients++;
+    return ip;
+}
+
+/* A client of the address disconnected. The state is freed with the last
+ * one: a client reconnecting right away gets a full bucket, but it pays a
+ * new connection for that. */
+void ipDetach(struct ipState *ip)
+{
+    if (--ip->clients > 0)
+        return;
+    dictDelete(&Chat->ips, ip->addr);
+    free(ip);
+}
+
+/* Check the buckets of the client 'c' and of its address before
+ * processing a line of 'len' bytes. Return 0 and take the tokens if the
+ * line is within the limits, otherwise return how many milliseconds it
+ * should wait. Lines longer than a second of bytes only need a full byte
+ * bucket, and leave it in debt. */
+int64_t rateCheck(struct client *c, size_t len)
+{
+    struct {
+        struct tokenBucket *b;
+        int rate;
+        int64_t need;
+    } buckets[4] = {
+        {&c->msgbucket, Config.ratemsgs, 1},
+        {&c->bytebucket, Config.ratebytes, len},
+        {&c->ip->msgbucket, Config.ipratemsgs, 1},
+        {&c->ip->bytebucket, Config.ipratebytes, len},
+    };
+    int64_t wait = 0;
+    for (int j = 0; j < 4; j++)
+    {
+        if (buckets[j].rate == 0)
+            continue; // No limit.
+        if (buckets[j].need > buckets[j].rate)
+            buckets[j].need = buckets[j].rate;
+        bucketRefill(buckets[j].b, buckets[j].rate);
+        int64_t w = bucketWait(buckets[j].b, buckets[j].rate,
+                               buckets[j].need);
+        if (w > wait)
+            wait = w;
+    }
+    if (wait)
+        return wait;
+    for (int j = 0; j < 4; j++)
+    {
+        if (buckets[j].rate)
+            buckets[j].b->tokens -= (j % 2 ? (int64_t)len : 1) * 1000;
+    }
+    return 0;
+}
+
+/* ================================== Rooms =====================================
+ * Clients talk inside rooms. A room is just a name and the set of its
+ * members, so a message sent to a room is delivered only to the clients
+ * that joined it, instead of to everybody connected. Every client joins
+ * DEFAULT_ROOM when it connects, and can then /join and /part other rooms:
+ * the last room joined is the current one, where its messages go.
+ *
+ * Rooms are created when the first client joins, and destroyed when the
+ * last member leaves, unless somebody ever talked there: then they have a
+ * history to show to the next client joining, and the sequence number of
+ * the last message, that must never go back. They are found by the
+ * interned id of their name via the Chat->rooms hash table.
+ *
+ * Every message sent to a room gets the next sequence number of the room,
+ * included in the message as "#room:seq", so that clients can notice when
+ * they missed messages and ask for just those with /resume.
+ *
+ * Every room remembers its last messages, so that clients joining it can
+ * see what was said before. The history is a ring of references to the
+ * same chunks we queued to the members when the message was sent: it
+ * costs no copy to remember a message, and no formatting to replay it.
+ * The ring is bounded both in number of messages and in total bytes.
+ * =========================================================================== */
+
+/* Return the room with the given name id, or NULL if it does not exist. */
+struct room *roomLookup(int name)
+{
+    return dictFind(&Chat->rooms, name);
+}
+
+/* Return true if the client joined the room. */
+int clientInRoom(struct client *c, struct room *r)
+{
+    return setHas(&r->members, c->fd);
+}
+
+/* Return the room with the given name id, creating it if needed. */
+struct room *roomGet(int name)
+{
+    struct room *r = roomLookup(name);
+    if (r == NULL)
+    {
+        r = chatMalloc(sizeof(*r));
+        memset(r, 0, sizeof(*r));
+        r->name = name;
+        internRetain(name);
+        dictAdd(&Chat->rooms, name, r);
+    }
+    return r;
+}
+
+/* Add the client to the room called 'name' (as a string of length 'len'),
+ * creating the room if needed, and make it the client current room.
+ * If 'joined' is not NULL, it is set to true if the client was not
+ * already a member. */
+struct room *roomJoin(struct client *c, const char *name, size_t len,
+                      int *joined)
+{
+    int id = internGet(name, len);
+    struct room *r = roomGet(id);
+    internRelease(id); // The room holds its own reference.
+
+    if (joined)
+        *joined = !clientInRoom(c, r);
+    if (!clientInRoom(c, r))
+    {
+        setAdd(&r->members, c->fd);
+        r->nummembers++;
+        c->rooms = chatRealloc(c->rooms, sizeof(int) * (c->numrooms + 1));
+        c->seen = chatRealloc(c->seen, sizeof(uint64_t) * (c->numrooms + 1));
+        /* The client is going to see the room history. */
+        struct history *h = &r->history;
+        c->seen[c->numrooms] =
+            h->count ? h->entries[h->first].seq - 1 : r->seq;
+        c->rooms[c->numrooms++] = r->name;
+        r->backlog += c->queued;
+    }
+    c->room = r->name;
+    return r;
+}
+
+/* Remember the message 'msg' sent by 'sender' in the room history,
+ * evicting the oldest messages if needed to stay in the budget. */
+void historyAppend(struct room *r, struct chunk *msg, int sender,
+                   uint64_t seq)
+{
+    struct history *h = &r->history;
+    while (h->count && (h->count == HISTORY_MAX_MSGS ||
+                        h->bytes + msg->u.used > HISTORY_MAX_BYTES))
+    {
+        struct historyEntry *old = h->entries + h->first;
+        h->bytes -= old->msg->u.used;
+        chunkRelease(old->msg);
+        internRelease(old->sender);
+        h->first = (h->first + 1) % HISTORY_MAX_MSGS;
+        h->count--;
+    }
+    if (msg->u.used > HISTORY_MAX_BYTES)
+        return; // Would not fit even alone.
+
+    struct historyEntry *e =
+        h->entries + (h->first + h->count) % HISTORY_MAX_MSGS;
+    chunkRetain(msg);
+    internRetain(sender);
+    e->msg = msg;
+    e->sender = sender;
+    e->seq = seq;
+    h->bytes += msg->u.used;
+    h->count++;
+}
+
+/* Release all the messages in the history. */
+void historyClear(struct history *h)
+{
+    while (h->count)
+    {
+        struct historyEntry *e = h->entries + h->first;
+        chunkRelease(e->msg);
+        internRelease(e->sender);
+        h->first = (h->first + 1) % HISTORY_MAX_MSGS;
+        h->count--;
+    }
+    h->bytes = 0;
+}
+
+/* Remove the client from the room, destroying the room if it is now
+ * empty. If it was the client current room, the most recently joined of
+ * the remaining rooms becomes the current one. */
+void roomPart(struct client *c, struct room *r)
+{
+    if (!clientInRoom(c, r))
+        return;
+    setDel(&r->members, c->fd);
+    r->nummembers--;
+    r->backlog -= c->queued;
+    for (int j = 0; j < c->numrooms; j++)
+    {
+        if (c->rooms[j] == r->name)
+        {
+            memmove(c->rooms + j, c->rooms + j + 1,
+                    sizeof(int) * (c->numrooms - j - 1));
+            memmove(c->seen + j, c->seen + j + 1,
+                    sizeof(uint64_t) * (c->numrooms - j - 1));
+            c->numrooms--;
+            break;
+        }
+    }
+    if (c->room == r->name)
+        c->room = c->numrooms ? c->rooms[c->numrooms - 1] : -1;
+
+    if (r->nummembers == 0 && r->seq == 0)
+    {
+        dictDelete(&Chat->rooms, r->name);
+        internRelease(r->name);
+        free(r->members.words);
+        free(r);
+    }
+}
+
+/* Remove the client from all its rooms. Used when the client is freed. */
+void roomPartAll(struct client *c)
+{
+    while (c->numrooms)
+        roomPart(c, roomLookup(c->rooms[c->numrooms - 1]));
+    free(c->rooms);
+    free(c->seen);
+    c->rooms = NULL;
+    c->seen = NULL;
+}
+
+/* ============================== Message log ===================================
+ * When started with --log-dir, every message sent to a room and every DM is
+ * appended to a log on disk, so that history survives restarts.
+ *
+ * The log is a sequence of segments named after the id of their first
+ * message, like 00000000000000000001. Messages are only appended to the
+ * last segment (the active one). When it grows over LOG_SEGMENT_SIZE it is
+ * sealed and a new segment is started: sealed segments never change again.
+ *
+ * Every segment is made of two files:
+ *
+ *   - The .dat file is the concatenation of the messages, exactly as they
+ *     were sent to the clients. It contains nothing else, so a range of
+ *     messages can be sent to a socket as it is, with sendfile(), without
+ *     the data ever entering our address space.
+ *   - The .log file is the sequence of records describing the messages:
+ *     a fixed header with the message id, time, room, sender, and the
+ *     offset and length of the message in the .dat file. Records are
+ *     padded to 8 bytes so that headers can be accessed in place in a
+ *     mmap()ed file.
+ *
+ * Rooms and nicks are referenced by the 64 bit hash of their interned
+ * names: the hash is stable across restarts, unlike interned ids. The first
+ * time a name is used in a segment, a LOG_NAME record with its hash is
+ * written, with the string right after the header in the .log file, so
+ * every segment is self contained.
+ *
+ * Every segment has a sparse index, with an entry every LOG_INDEX_INTERVAL
+ * bytes of records mapping message id and time to file offsets, so that a
+ * message can be found without scanning the whole segment. Every room has
+ * its own sparse index in every segment too, with the number of its
+ * messages and the position of one every LOG_ROOM_INDEX_INTERVAL, so that
+ * the last N messages of a room are found without visiting the messages
+ * of the other rooms. The indexes of a sealed segment are saved in a .idx
+ * file; only the active segment is scanned at startup, so startup does
+ * not depend on the size of the log.
+ *
+ * Every segment also has a full text search index, see searchIndexAdd().
+ *
+ * Appending never blocks the event loop on the disk: records and messages
+ * accumulate in buffers that are written before poll(), and the fsync()
+ * happens once per second in a background thread.
+ * =========================================================================== */
+
+#define LOG_SEGMENT_SIZE (64*1024*1024)   // Seal segments over this size.
+#define LOG_INDEX_INTERVAL (64*1024)      // Bytes between index entries.
+#define LOG_ROOM_INDEX_INTERVAL 64        // Room messages between entries.
+#define LOG_REPLAY_BYTES (16*1024*1024)   // Log tail replayed at startup.
+#define LOG_VERIFY_THREADS 8              // Max threads checking CRCs.
+#define LOG_HISTORY_MAX 10000             // Max messages of a /history.
+#define LOG_HISTORY_PAGE 100              // Messages sent per loop iteration.
+#define LOG_INDEX_MAGIC 0x5844494c54414843ULL // "CHATLIDX".
+#define LOG_INDEX_VERSION 4
+
+#define LOG_NAME 1      // Defines the string of a name hash.
+#define LOG_ROOM_MSG 2  // A message sent to a room.
+#define LOG_DM 3        // A direct message.
+
+/* Record header. All the fields are in host byte order. */
+struct logRecord
+{
+    uint32_t len;        // Record length, header and padding included.
+    uint32_t crc;        // CRC32 of the record after this field, and of
+                         // the message in the .dat file.
+    uint64_t id;         // Message id, 0 for LOG_NAME records.
+    int64_t mstime;      // Unix time in milliseconds.
+    uint64_t room;       // Room name hash, 0 if not a room message.
+    uint64_t from;       // Sender nick hash, or the hash for LOG_NAME.
+    uint64_t to;         // Recipient nick hash for DMs, otherwise 0.
+    uint64_t dataoffset; // Offset of the message in the .dat file.
+    uint64_t seq;        // Sequence number in the room, or 0.
+    uint32_t type;       // LOG_* record type.
+    uint32_t payloadlen; // Length of the message, or of the LOG_NAME string.
+};
+
+struct logIndexEntry
+{
+    uint64_t id;         // Id of the first message at 'offset'.
+    int64_t mstime;      // Time of that message.
+    uint64_t offset;     // Offset of its record in the .log file.
+};
+
+/* Header of the .idx file of a sealed segment, followed by the entries. */
+struct logIndexHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t indexlen;   // Number of entries.
+    uint64_t firstid, lastid;
+    int64_t firsttime, lasttime;
+    uint64_t size;       // Size of the files the index refers to.
+    uint64_t datasize;
+    uint64_t count;      // Number of messages in the segment.
+    uint64_t numrooms;   // Entries of the rooms table after the index.
+    uint64_t numroomindex; // Rooms indexes after the rooms table.
+};
+
+/* The .idx file of a sealed segment also saves the sequence number of
+ * every room at the time the segment was sealed, so that at startup the
+ * rooms can continue from there without scanning the whole log. */
+struct logRoomSeq
+{
+    uint64_t seq;
+    char name[40];       // Null terminated, MAX_ROOM_LEN at most.
+};
+
+/* The index of the messages of a room in a segment: entry j is the
+ * message number j * LOG_ROOM_INDEX_INTERVAL of the room in the segment.
+ * In the .idx file the entries follow a logRoomIndexHeader. */
+struct logRoomEntry
+{
+    uint64_t id;
+    uint64_t offset;     // Offset of its record in the .log file.
+};
+
+struct logRoomIndex
+{
+    uint64_t count;      // Messages of the room in the segment.
+    struct logRoomEntry *entries;
+    uint64_t len, cap;
+};
+
+struct logRoomIndexHeader
+{
+    uint64_t hash;       // Room name hash.
+    uint64_t count;
+    uint64_t len;        // Entries following.
+};
+
+struct logSegment
+{
+    uint64_t firstid;    // Id of the first message, also the file name.
+    uint64_t lastid;     // Id of the last message, firstid-1 if empty.
+    int64_t firsttime;   // Time of the first and last messages.
+    int64_t lasttime;
+    uint64_t size;       // Size of the .log file, including the records
+                         // still in the buffer.
+    uint64_t datasize;   // The same for the .dat file.
+    uint64_t count;      // Number of messages.
+    int fd;              // The .log file.
+    int datafd;          // The .dat file.
+    struct logIndexEntry *index;
+    int indexlen, indexcap;
+    struct dict rooms;   // Room hash -> struct logRoomIndex.
+    struct dict terms;   // Search index of the active segment: word
+                         // hash -> struct searchPosting.
+    char *sdx;           // Search index of a sealed segment, mmap()ed.
+    size_t sdxlen;
+};
+
+/* Bytes appended to a log file but not written yet. */
+struct logBuffer
+{
+    char *p;
+    size_t len, cap;
+};
+
+struct messageLog
+{
+    char *dir;                     // NULL if the log is disabled.
+    struct logSegment **segments;  // Sorted by first id. The last is active.
+    int numsegments;
+    uint64_t nextid;               // Id of the next message.
+    struct logBuffer recbuf;       // Records not yet in the .log file.
+    struct logBuffer databuf;      // Messages not yet in the .dat file.
+    struct dict names;             // Hashes defined in the active segment.
+    int dirty;                     // Written since the last fsync.
+    int fsyncing;                  // A background fsync is in progress.
+    uint64_t fsyncs;               // Completed fsyncs, for /stats.
+};
+
+struct messageLog Log = {.nextid = 1};
+
+/* CRC32 (IEEE), the table is computed the first time. */
+uint32_t crc32(uint32_t crc, const void *data, size_t len)
+{
+    static uint32_t table[256];
+    static int initialized = 0;
+    if (!initialized)
+    {
+        for (uint32_t j = 0; j < 256; j++)
+        {
+            uint32_t c = j;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[j] = c;
+        }
+        initialized = 1;
+    }
+    const unsigned char *p = data;
+    crc = ~crc;
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* Current Unix time in milliseconds. */
+int64_t mstime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Length of a record of the given type and payload length in the .log
+ * file, padding included. Only LOG_NAME records have the payload there. */
+size_t logRecordLen(uint32_t type, size_t payloadlen)
+{
+    if (type != LOG_NAME)
+        payloadlen = 0;
+    return (sizeof(struct logRecord) + payloadlen + 7) & ~(size_t)7;
+}
+
+/* Return the payload of a record, given the content of the .dat file. */
+const char *logPayload(const struct logRecord *r, const char *data)
+{
+    return r->type == LOG_NAME ? (const char *)(r + 1) : data + r->dataoffset;
+}
+
+/* Checksum of the record header (after the crc field) and its payload. */
+uint32_t logRecordCrc(const struct logRecord *r, const char *payload)
+{
+    uint32_t crc = crc32(0, (const char *)r + 8, sizeof(*r) - 8);
+    return crc32(crc, payload, r->payloadlen);
+}
+
+/* Return true if the record at 'p', with 'avail' bytes of the .log file
+ * after it, is complete, its message is inside the 'datasize' bytes of
+ * the .dat file at 'data', and the checksum matches. */
+int logRecordIsValid(const char *p, size_t avail, const char *data,
+                     uint64_t datasize)
+{
+    const struct logRecord *r = (const struct logRecord *)p;
+    if (avail < sizeof(*r) || r->len < sizeof(*r) || r->len > avail ||
+        r->len != logRecordLen(r->type, r->payloadlen))
+        return 0;
+    if (r->type != LOG_NAME && (r->dataoffset > datasize ||
+                                r->payloadlen > datasize - r->dataoffset))
+        return 0;
+    return logRecordCrc(r, logPayload(r, data)) == r->crc;
+}
+
+void logSegmentPath(char *buf, size_t buflen, uint64_t firstid,
+                    const char *ext)
+{
+    snprintf(buf, buflen, "%s/%020llu.%s", Log.dir,
+             (unsigned long long)firstid, ext);
+}
+
+void logAddIndexEntry(struct logSegment *seg, uint64_t id, int64_t time,
+                      uint64_t offset)
+{
+    if (seg->indexlen == seg->indexcap)
+    {
+        seg->indexcap = seg->indexcap ? seg->indexcap * 2 : 64;
+        seg->index = chatRealloc(seg->index,
+                                 sizeof(*seg->index) * seg->indexcap);
+    }
+    seg->index[seg->indexlen].id = id;
+    seg->index[seg->indexlen].mstime = time;
+    seg->index[seg->indexlen].offset = offset;
+    seg->indexlen++;
+}
+
+void logRoomIndexFree(uint64_t key, void *val, void *privdata)
+{
+    (void)key;
+    (void)privdata;
+    struct logRoomIndex *ri = val;
+    free(ri->entries);
+    free(ri);
+}
+
+/* Add the room message at 'offset' to the index of its room. */
+void logRoomIndexAdd(struct logSegment *seg, const struct logRecord *r,
+                     uint64_t offset)
+{
+    struct logRoomIndex *ri = dictFind(&seg->rooms, r->room);
+    if (ri == NULL)
+    {
+        ri = chatMalloc(sizeof(*ri));
+        memset(ri, 0, sizeof(*ri));
+        dictAdd(&seg->rooms, r->room, ri);
+    }
+    if (ri->count % LOG_ROOM_INDEX_INTERVAL == 0)
+    {
+        if (ri->len == ri->cap)
+        {
+            ri->cap = ri->cap ? ri->cap * 2 : 4;
+            ri->entries = chatRealloc(ri->entries,
+                                      sizeof(*ri->entries) * ri->cap);
+        }
+        ri->entries[ri->len].id = r->id;
+        ri->entries[ri->len].offset = offset;
+        ri->len++;
+    }
+    ri->count++;
+}
+
+/* Update the segment metadata for a message record at 'offset'. */
+void logSegmentTrack(struct logSegment *seg, const struct logRecord *r,
+                     uint64_t offset)
+{
+    if (seg->count == 0)
+    {
+        seg->firstid = r->id;
+        seg->firsttime = r->mstime;
+    }
+    if (seg->indexlen == 0 ||
+        offset - seg->index[seg->indexlen - 1].offset >= LOG_INDEX_INTERVAL)
+        logAddIndexEntry(seg, r->id, r->mstime, offset);
+    if (r->type == LOG_ROOM_MSG)
+        logRoomIndexAdd(seg, r, offset);
+    seg->lastid = r->id;
+    seg->lasttime = r->mstime;
+    seg->count++;
+}
+
+struct logSegment *logActiveSegment(void)
+{
+    return Log.segments[Log.numsegments - 1];
+}
+
+/* Open the files of the segment starting with 'firstid', creating them if
+ * 'create' is true, and add it to the segments list. Exits on errors. */
+struct logSegment *logOpenSegment(uint64_t firstid, int create)
+{
+    char path[1024];
+    int flags = O_RDWR | O_APPEND | (create ? O_CREAT : 0);
+    struct logSegment *seg = chatMalloc(sizeof(*seg));
+    memset(seg, 0, sizeof(*seg));
+    seg->firstid = firstid;
+    seg->lastid = firstid - 1;
+    logSegmentPath(path, sizeof(path), firstid, "log");
+    seg->fd = open(path, flags, 0644);
+    logSegmentPath(path, sizeof(path), firstid, "dat");
+    seg->datafd = open(path, flags | O_CREAT, 0644);
+    struct stat st, datast;
+    if (seg->fd == -1 || seg->datafd == -1 || fstat(seg->fd, &st) == -1 ||
+        fstat(seg->datafd, &datast) == -1)
+    {
+        perror("Opening log segment");
+        exit(1);
+    }
+    seg->size = st.st_size;
+    seg->datasize = datast.st_size;
+    Log.segments = chatRealloc(Log.segments,
+                               sizeof(seg) * (Log.numsegments + 1));
+    Log.segments[Log.numsegments++] = seg;
+    return seg;
+}
+
+/* Add the sequence number of a room to the table being built. */
+void logCollectRoomSeq(uint64_t key, void *val, void *privdata)
+{
+    (void)key;
+    struct room *r = val;
+    struct logRoomSeq **rs = privdata;
+    if (r->seq == 0)
+        return;
+    memset(*rs, 0, sizeof(**rs));
+    (*rs)->seq = r->seq;
+    memcpy((*rs)->name, internStr(r->name), internLen(r->name));
+    (*rs)++;
+}
+
+/* State of logSaveRoomIndex() while writing the rooms indexes. */
+struct logSaveState
+{
+    FILE *fp;
+    int err;
+};
+
+void logSaveRoomIndex(uint64_t key, void *val, void *privdata)
+{
+    struct logRoomIndex *ri = val;
+    struct logSaveState *ss = privdata;
+    struct logRoomIndexHeader rh = {key, ri->count, ri->len};
+    if (ss->err ||
+        fwrite(&rh, sizeof(rh), 1, ss->fp) != 1 ||
+        fwrite(ri->entries, sizeof(*ri->entries), ri->len, ss->fp) != ri->len)
+        ss->err = 1;
+}
+
+/* Write the index of a sealed segment in its .idx file, together with the
+ * rooms sequence numbers 'rooms' and the rooms indexes. Errors are not fatal: without the file,
+ * the segment is just scanned at startup. Called by a background thread
+ * too, see logSeal(): it only reads what does not change anymore once the
+ * segment is sealed. */
+void logSaveIndex(struct logSegment *seg, struct logRoomSeq *rooms,
+                  uint64_t numrooms)
+{
+    char path[1024], tmppath[1100];
+    logSegmentPath(path, sizeof(path), seg->firstid, "idx");
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+    struct logIndexHeader h = {
+        .magic = LOG_INDEX_MAGIC, .version = LOG_INDEX_VERSION,
+        .indexlen = seg->indexlen, .firstid = seg->firstid,
+        .lastid = seg->lastid, .firsttime = seg->firsttime,
+        .lasttime = seg->lasttime, .size = seg->size,
+        .datasize = seg->datasize, .count = seg->count,
+        .numrooms = numrooms, .numroomindex = seg->rooms.used};
+    struct logSaveState ss = {fopen(tmppath, "w"), 0};
+    ss.err = ss.fp == NULL ||
+             fwrite(&h, sizeof(h), 1, ss.fp) != 1 ||
+             fwrite(seg->index, sizeof(*seg->index), seg->indexlen,
+                    ss.fp) != (size_t)seg->indexlen ||
+             fwrite(rooms, sizeof(*rooms), h.numrooms, ss.fp) != h.numrooms;
+    dictForEach(&seg->rooms, logSaveRoomIndex, &ss);
+    if (!ss.err && (fflush(ss.fp) != 0 || fsync(fileno(ss.fp)) == -1))
+        ss.err = 1;
+    if (ss.fp && fclose(ss.fp) != 0)
+        ss.err = 1;
+    if (ss.err || rename(tmppath, path) == -1)
+    {
+        perror("Saving log segment index");
+        unlink(tmppath);
+    }
+}
+
+/* Make sure the room 'name' exists, with a sequence number of at least
+ * 'seq'. Used when loading the log. */
+void logRestoreRoomSeq(int name, uint64_t seq)
+{
+    struct room *r = roomGet(name);
+    if (seq > r->seq)
+        r->seq = seq;
+}
+
+/* Load 'count' rooms indexes of a sealed segment of 'messages' messages
+ * from its .idx file. Return -1 on errors. */
+int logLoadRoomIndex(struct logSegment *seg, FILE *fp, uint64_t count,
+                     uint64_t messages)
+{
+    for (uint64_t j = 0; j < count; j++)
+    {
+        struct logRoomIndexHeader rh;
+        if (fread(&rh, sizeof(rh), 1, fp) != 1 || rh.count > messages ||
+            rh.len != (rh.count + LOG_ROOM_INDEX_INTERVAL - 1) /
+                      LOG_ROOM_INDEX_INTERVAL ||
+            dictFind(&seg->rooms, rh.hash))
+            return -1;
+        struct logRoomIndex *ri = chatMalloc(sizeof(*ri));
+        ri->count = rh.count;
+        ri->len = ri->cap = rh.len;
+        ri->entries = chatMalloc(sizeof(*ri->entries) * (rh.len + 1));
+        dictAdd(&seg->rooms, rh.hash, ri);
+        if (fread(ri->entries, sizeof(*ri->entries), rh.len, fp) != rh.len)
+            return -1;
+    }
+    return 0;
+}
+
+/* Load the .idx file of a sealed segment, restoring the rooms sequence
+ * numbers. Return -1 if it is missing or does not match the segment, that
+ * will then be scanned. */
+int logLoadIndex(struct logSegment *seg)
+{
+    char path[1024];
+    struct logIndexHeader h;
+    logSegmentPath(path, sizeof(path), seg->firstid, "idx");
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    int retval = -1;
+    if (fread(&h, sizeof(h), 1, fp) == 1 && h.magic == LOG_INDEX_MAGIC &&
+        h.version == LOG_INDEX_VERSION && h.size == seg->size &&
+        h.datasize == seg->datasize && h.firstid == seg->firstid)
+    {
+        seg->index = chatMalloc(sizeof(*seg->index) * (h.indexlen + 1));
+        seg->indexcap = h.indexlen + 1;
+        if (fread(seg->index, sizeof(*seg->index), h.indexlen, fp) ==
+            h.indexlen)
+        {
+            struct logRoomSeq rs;
+            for (uint64_t j = 0; j < h.numrooms; j++)
+            {
+                if (fread(&rs, sizeof(rs), 1, fp) != 1)
+                    break;
+                rs.name[sizeof(rs.name) - 1] = '\0';
+                int name = internGet(rs.name, strlen(rs.name));
+                logRestoreRoomSeq(name, rs.seq);
+                internRelease(name);
+            }
+            if (logLoadRoomIndex(seg, fp, h.numroomindex, h.count) == -1)
+            {
+                dictEmpty(&seg->rooms, logRoomIndexFree, NULL);
+            }
+            else
+            {
+                seg->indexlen = h.indexlen;
+                seg->lastid = h.lastid;
+                seg->firsttime = h.firsttime;
+                seg->lasttime = h.lasttime;
+                seg->count = h.count;
+                retval = 0;
+            }
+        }
+    }
+    fclose(fp);
+    return retval;
+}
+
+/* Map a segment file of 'size' bytes in memory, read only. Return NULL on
+ * error or if the file is empty. Unmap with munmap(p, size). Data still in
+ * the append buffers is not in the files yet, so call logFlush() first if
+ * it is needed. */
+char *logMapFile(int fd, uint64_t size)
+{
+    if (size == 0)
+        return NULL;
+    char *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        perror("mmap() of log segment");
+        return NULL;
+    }
+    return p;
+}
+
+/* Every segment also has a full text search index: for every word found in
+ * the room messages, the list of records containing it (a posting list).
+ * Record offsets in a list are increasing, so they are stored as the
+ * varint encoded difference with the previous one: most deltas take one
+ * or two bytes. The index of the active segment is a hash table of
+ * growing posting lists, updated as messages are appended. When the
+ * segment is sealed the lists are saved, sorted by word hash, in a .sdx
+ * file that is then used mmap()ed, so sealed indexes take no heap memory
+ * and can be read by the background threads without locking. */
+
+#define SEARCH_MIN_TOKEN 2       // Shorter words are not indexed.
+#define SEARCH_MAX_TOKEN 32      // Longer words are truncated.
+#define SEARCH_MAGIC 0x5844534c54414843ULL // "CHATLSDX".
+#define SEARCH_VERSION 1
+
+struct searchPosting
+{
+    unsigned char *buf;      // Varint deltas of record offsets / 8.
+    size_t len, cap;
+    uint64_t last;           // Last offset / 8 added.
+    uint64_t count;          // Records in the list.
+};
+
+/* Header of a .sdx file, followed by 'numterms' searchFileTerm sorted by
+ * hash, followed by the posting lists. */
+struct searchFileHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t numterms;
+    uint64_t size;           // Size of the .log file indexed.
+};
+
+struct searchFileTerm
+{
+    uint64_t hash;           // Hash of the lowercase word.
+    uint64_t offset;         // Offset of the posting list in the file.
+    uint64_t len;            // Bytes of the posting list.
+    uint64_t count;
+};
+
+/* Store 'v' at 'p' as a varint: 7 bits per byte, the high bit set in all
+ * the bytes but the last. Return the number of bytes used, at most 10. */
+int varintPut(unsigned char *p, uint64_t v)
+{
+    int n = 0;
+    while (v >= 0x80)
+    {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+/* Decode a varint at '*p', advancing it. Return -1 if it does not end
+ * before 'end'. */
+int varintGet(const unsigned char **p, const unsigned char *end,
+              uint64_t *v)
+{
+    uint64_t val = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *(*p)++;
+        val |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *v = val;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Return the text written by the user in a room message, skipping the
+ * "[time] #room nick> " prefix that every message has. */
+const char *searchText(const char *msg, size_t *len)
+{
+    for (size_t j = 0; j + 1 < *len; j++)
+    {
+        if (msg[j] == '>' && msg[j + 1] == ' ')
+        {
+            *len -= j + 2;
+            return msg + j + 2;
+        }
+    }
+    return msg;
+}
+
+/* Find the next word of s[0..len-1] starting from '*pos', store it in
+ * lowercase in 'tok' (SEARCH_MAX_TOKEN bytes) and return its length. The
+ * words are runs of ASCII letters and digits, or of bytes >= 128 so that
+ * UTF-8 text is indexed too. Return 0 when there are no more words. */
+size_t searchNextToken(const char *s, size_t len, size_t *pos, char *tok)
+{
+    while (*pos < len)
+    {
+        size_t toklen = 0;
+        while (*pos < len)
+        {
+            unsigned char c = s[*pos];
+            if (!(c >= 128 || (c >= '0' && c <= '9') ||
+                  (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')))
+                break;
+            if (toklen < SEARCH_MAX_TOKEN)
+                tok[toklen++] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+            (*pos)++;
+        }
+        (*pos)++; // Skip the separator.
+        if (toklen >= SEARCH_MIN_TOKEN)
+            return toklen;
+    }
+    return 0;
+}
+
+/* Index the words of the room message 'msg', at 'offset' in the .log
+ * file of the segment. */
+void searchIndexAdd(struct logSegment *seg, uint64_t offset,
+                    const char *msg, size_t len)
+{
+    char tok[SEARCH_MAX_TOKEN];
+    size_t toklen, pos = 0;
+    const char *text = searchText(msg, &len);
+    uint64_t cur = offset / 8;
+    while ((toklen = searchNextToken(text, len, &pos, tok)) != 0)
+    {
+        uint64_t hash = internHashString(tok, toklen);
+        struct searchPosting *p = dictFind(&seg->terms, hash);
+        if (p == NULL)
+        {
+            p = chatMalloc(sizeof(*p));
+            memset(p, 0, sizeof(*p));
+            dictAdd(&seg->terms, hash, p);
+        }
+        else if (p->last == cur)
+        {
+            continue; // Repeated word in the same message.
+        }
+        if (p->len + 10 > p->cap)
+        {
+            p->cap = p->cap ? p->cap * 2 : 16;
+            p->buf = chatRealloc(p->buf, p->cap);
+        }
+        p->len += varintPut(p->buf + p->len, cur - p->last);
+        p->last = cur;
+        p->count++;
+    }
+}
+
+void searchPostingFree(uint64_t key, void *val, void *privdata)
+{
+    (void)key;
+    (void)privdata;
+    struct searchPosting *p = val;
+    free(p->buf);
+    free(p);
+}
+
+/* Collect the terms of the in memory index, to sort them. */
+void searchCollectTerm(uint64_t key, void *val, void *privdata)
+{
+    struct searchFileTerm **t = privdata;
+    struct searchPosting *p = val;
+    (*t)->hash = key;
+    (*t)->len = p->len;
+    (*t)->count = p->count;
+    (*t)++;
+}
+
+int searchCompareTerms(const void *a, const void *b)
+{
+    uint64_t x = ((const struct searchFileTerm *)a)->hash;
+    uint64_t y = ((const struct searchFileTerm *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+/* Map the .sdx file of a sealed segment. Return -1 if it is missing or
+ * does not match the segment, that will then be scanned to rebuild it. */
+int searchIndexLoad(struct logSegment *seg)
+{
+    char path[1024];
+    logSegmentPath(path, sizeof(path), seg->firstid, "sdx");
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 ||
+        (size_t)st.st_size < sizeof(struct searchFileHeader))
+    {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    char *map = logMapFile(fd, st.st_size);
+    close(fd);
+    if (map == NULL)
+        return -1;
+    struct searchFileHeader *h = (struct searchFileHeader *)map;
+    uint64_t start = sizeof(*h) + (uint64_t)h->numterms *
+                     sizeof(struct searchFileTerm);
+    int valid = h->magic == SEARCH_MAGIC && h->version == SEARCH_VERSION &&
+                h->size == seg->size && start <= (uint64_t)st.st_size;
+
+    /* Lookups trust the terms table: a posting list out of the file would
+     * be read past the mapping. Check them all once here. */
+    const struct searchFileTerm *terms = (const void *)(h + 1);
+    for (uint32_t j = 0; valid && j < h->numterms; j++)
+        valid = terms[j].offset >= start &&
+                terms[j].offset <= (uint64_t)st.st_size &&
+                terms[j].len <= (uint64_t)st.st_size - terms[j].offset;
+    if (!valid)
+    {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    seg->sdx = map;
+    seg->sdxlen = st.st_size;
+    return 0;
+}
+
+/* Save the in memory index of a sealed segment in its .sdx file. Errors
+ * are not fatal: the file is rebuilt at the next restart. Like
+ * logSaveIndex(), called by a background thread, while the event loop
+ * goes on searching the in memory index. */
+void searchIndexSave(struct logSegment *seg)
+{
+    char path[1024], tmppath[1100];
+    logSegmentPath(path, sizeof(path), seg->firstid, "sdx");
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    struct searchFileHeader h = {
+        .magic = SEARCH_MAGIC, .version = SEARCH_VERSION,
+        .numterms = seg->terms.used, .size = seg->size};
+    struct searchFileTerm *terms = chatMalloc(sizeof(*terms) * (h.numterms + 1));
+    struct searchFileTerm *t = terms;
+    dictForEach(&seg->terms, searchCollectTerm, &t);
+    qsort(terms, h.numterms, sizeof(*terms), searchCompareTerms);
+    uint64_t offset = sizeof(h) + sizeof(*terms) * h.numterms;
+    for (uint32_t j = 0; j < h.numterms; j++)
+    {
+        terms[j].offset = offset;
+        offset += terms[j].len;
+    }
+
+    FILE *fp = fopen(tmppath, "w");
+    int err = fp == NULL ||
+              fwrite(&h, sizeof(h), 1, fp) != 1 ||
+              fwrite(terms, sizeof(*terms), h.numterms, fp) != h.numterms;
+    for (uint32_t j = 0; !err && j < h.numterms; j++)
+    {
+        struct searchPosting *p = dictFind(&seg->terms, terms[j].hash);
+        err = fwrite(p->buf, 1, p->len, fp) != p->len;
+    }
+    if (!err && (fflush(fp) != 0 || fsync(fileno(fp)) == -1))
+        err = 1;
+    if (fp && fclose(fp) != 0)
+        err = 1;
+    if (err || rename(tmppath, path) == -1)
+    {
+        perror("Saving log segment search index");
+        unlink(tmppath);
+    }
+    free(terms);
+}
+
+/* Return the posting list of the word 'hash' in the .sdx file mapped at
+ * 'sdx', setting '*len', or NULL if the word is not there. */
+const unsigned char *searchFileLookup(const char *sdx, uint64_t hash,
+                                      size_t *len)
+{
+    const struct searchFileHeader *h = (const void *)sdx;
+    const struct searchFileTerm *terms = (const void *)(h + 1);
+    int lo = 0, hi = (int)h->numterms - 1;
+    while (lo <= hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (terms[mid].hash == hash)
+        {
+            *len = terms[mid].len;
+            return (const unsigned char *)sdx + terms[mid].offset;
+        }
+        if (terms[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+/* Append 'len' bytes to a log buffer. */
+void logBufferAppend(struct logBuffer *b, const void *p, size_t len)
+{
+    if (b->len + len > b->cap)
+    {
+        b->cap = (b->len + len) * 2;
+        b->p = chatRealloc(b->p, b->cap);
+    }
+    memcpy(b->p + b->len, p, len);
+    b->len += len;
+}
+
+/* Write the content of the buffer to 'fd'. Return 0 if everything was
+ * written, -1 otherwise: what was not written stays in the buffer. */
+int logBufferWrite(struct logBuffer *b, int fd)
+{
+    size_t written = 0;
+    int retval = 0;
+    while (written < b->len)
+    {
+        ssize_t nwritten = write(fd, b->p + written, b->len - written);
+        if (nwritten == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            /* Disk full or similar: keep the data, retry later. */
+            perror("Writing the message log");
+            retval = -1;
+            break;
+        }
+        written += nwritten;
+    }
+    if (written)
+    {
+        memmove(b->p, b->p + written, b->len - written);
+        b->len -= written;
+        Log.dirty = 1;
+    }
+    return retval;
+}
+
+/* Write the buffered messages and records to the active segment. Called
+ * before every poll(), so a burst of messages costs a couple of write()
+ * calls. The write only copies the data in the kernel page cache: it is
+ * the fsync(), done in the background, that waits for the disk.
+ *
+ * Messages are written before the records referencing them: a record is
+ * never in the .log file without its message in the .dat file.
+ *
+ * Return 0 if the buffers are empty now, -1 if something could not be
+ * written (disk full or similar) and is still there, to retry later. */
+int logFlush(void)
+{
+    if (Log.dir == NULL)
+        return 0;
+    struct logSegment *seg = logActiveSegment();
+    if (logBufferWrite(&Log.databuf, seg->datafd) == 0)
+        logBufferWrite(&Log.recbuf, seg->fd);
+    return Log.databuf.len || Log.recbuf.len ? -1 : 0;
+}
+
+/* Descriptors of the segment files for a background fsync. */
+struct logFsyncJob
+{
+    int fd, datafd;
+};
+
+void logFsyncWork(void *arg)
+{
+    struct logFsyncJob *job = arg;
+    fdatasync(job->datafd);
+    fdatasync(job->fd);
+    close(job->datafd);
+    close(job->fd);
+}
+
+void logFsyncDone(void *arg)
+{
+    free(arg);
+    Log.fsyncing = 0;
+    Log.fsyncs++;
+}
+
+/* Start a background fsync of the segment. The background thread gets its
+ * own descriptors, so the segment can be closed meanwhile. */
+void logBackgroundFsync(struct logSegment *seg)
+{
+    struct logFsyncJob *job = chatMalloc(sizeof(*job));
+    job->fd = dup(seg->fd);
+    job->datafd = dup(seg->datafd);
+    if (job->fd == -1 || job->datafd == -1)
+    {
+        if (job->fd != -1) close(job->fd);
+        if (job->datafd != -1) close(job->datafd);
+        free(job);
+        return;
+    }
+    Log.fsyncing = 1;
+    Log.dirty = 0;
+    bioSubmit(logFsyncWork, logFsyncDone, job);
+}
+
+/* The files of a sealed segment to write, see logSeal(). */
+struct logSealJob
+{
+    struct logSegment *seg;
+    struct logRoomSeq *rooms;  // Rooms sequence numbers when sealed.
+    uint64_t numrooms;
+};
+
+void logSealWork(void *arg)
+{
+    struct logSealJob *job = arg;
+    logSaveIndex(job->seg, job->rooms, job->numrooms);
+    searchIndexSave(job->seg);
+}
+
+/* Switch the segment to the .sdx file just written. If it can't be
+ * loaded, the in memory index is kept: searches still work. */
+void logSealDone(void *arg)
+{
+    struct logSealJob *job = arg;
+    if (searchIndexLoad(job->seg) == 0)
+        dictEmpty(&job->seg->terms, searchPostingFree, NULL);
+    free(job->rooms);
+    free(job);
+}
+
+/* Write the .idx and .sdx files of a segment that was just sealed, or
+ * rebuilt at startup. Sorting, writing and syncing the search index of a
+ * full segment takes a while, so this is done by a background thread.
+ * Meanwhile the segment is searched using the index in memory, that is
+ * only released when the .sdx file is ready. */
+void logSeal(struct logSegment *seg)
+{
+    struct logSealJob *job = chatMalloc(sizeof(*job));
+    job->seg = seg;
+    job->rooms = chatMalloc(sizeof(*job->rooms) * (Chat->rooms.used + 1));
+    struct logRoomSeq *rs = job->rooms;
+    dictForEach(&Chat->rooms, logCollectRoomSeq, &rs);
+    job->numrooms = rs - job->rooms;
+    bioSubmit(logSealWork, logSealDone, job);
+}
+
+/* Seal the active segment and start a new one. What is still in the
+ * buffers belongs to the active segment, with offsets in its files, so
+ * if it can't be written the rotation is postponed to the next append. */
+void logRotate(void)
+{
+    struct logSegment *seg = logActiveSegment();
+    if (logFlush() == -1)
+        return;
+    logSeal(seg);
+    logBackgroundFsync(seg);
+    logOpenSegment(Log.nextid, 1);
+    dictEmpty(&Log.names, NULL, NULL); // Names are per segment.
+}
+
+/* Append a record to the buffers, updating the active segment metadata.
+ * The payload goes in the .dat file, or after the header for LOG_NAME. */
+void logAppendRecord(uint32_t type, uint64_t id, int64_t time, uint64_t room,
+                     uint64_t from, uint64_t to, uint64_t seq,
+                     const char *payload, size_t len)
+{
+    static const char padding[8];
+    struct logSegment *seg = logActiveSegment();
+    size_t reclen = logRecordLen(type, len);
+    struct logRecord r = {
+        .len = reclen, .id = id, .mstime = time, .room = room,
+        .from = from, .to = to, .seq = seq, .type = type, .payloadlen = len,
+        .dataoffset = type == LOG_NAME ? 0 : seg->datasize};
+    r.crc = logRecordCrc(&r, payload);
+    if (type != LOG_NAME)
+        logSegmentTrack(seg, &r, seg->size);
+    if (type == LOG_ROOM_MSG)
+        searchIndexAdd(seg, seg->size, payload, len);
+    logBufferAppend(&Log.recbuf, &r, sizeof(r));
+    if (type == LOG_NAME)
+    {
+        logBufferAppend(&Log.recbuf, payload, len);
+        logBufferAppend(&Log.recbuf, padding, reclen - sizeof(r) - len);
+    }
+    else
+    {
+        logBufferAppend(&Log.databuf, payload, len);
+        seg->datasize += len;
+    }
+    seg->size += reclen;
+}
+
+/* Make sure the interned name 'id' is defined in the active segment, and
+ * return its hash. */
+uint64_t logName(int id)
+{
+    uint64_t hash = internHash(id);
+    if (dictFind(&Log.names, hash) == NULL)
+    {
+        logAppendRecord(LOG_NAME, 0, 0, 0, hash, 0, 0, internStr(id),
+                        internLen(id));
+        dictAdd(&Log.names, hash, (void *)1);
+    }
+    return hash;
+}
+
+/* Log a message of the given LOG_* type, sent by the nick 'from' to the
+ * room 'room' with sequence number 'seq', or to the nick 'to' (-1 and 0
+ * if not applicable), and return its id. Messages get an id even when the
+ * log is disabled. */
+uint64_t logAppend(uint32_t type, int room, int from, int to, uint64_t seq,
+                   const char *payload, size_t len)
+{
+    if (Log.dir == NULL)
+        return Log.nextid++;
+    if (logActiveSegment()->datasize >= LOG_SEGMENT_SIZE)
+        logRotate();
+    uint64_t id = Log.nextid++;
+    uint64_t roomhash = room != -1 ? logName(room) : 0;
+    uint64_t fromhash = from != -1 ? logName(from) : 0;
+    uint64_t tohash = to != -1 ? logName(to) : 0;
+    logAppendRecord(type, id, Clock.mstime, roomhash, fromhash, tohash, seq,
+                    payload, len);
+    return id;
+}
+
+/* Set '*segment' and '*offset' to where the last message passed to
+ * logAppend() is in the .dat files. Return -1 if the log is disabled. */
+int logLastMessage(size_t len, int *segment, uint64_t *offset)
+{
+    if (Log.dir == NULL)
+        return -1;
+    *segment = Log.numsegments - 1;
+    *offset = logActiveSegment()->datasize - len;
+    return 0;
+}
+
+/* Called once per second: fsync what we wrote since the last time. */
+void logCron(void)
+{
+    if (Log.dir && Log.dirty && !Log.fsyncing)
+        logBackgroundFsync(logActiveSegment());
+}
+
+/* Write the buffered messages and wait until they are on disk. Used when
+ * exiting, when there is nothing better to do than waiting. */
+void logSync(void)
+{
+    if (Log.dir == NULL)
+        return;
+    logFlush();
+    struct logSegment *seg = logActiveSegment();
+    fdatasync(seg->datafd);
+    fdatasync(seg->fd);
+    Log.dirty = 0;
+}
+
+/* Size of the .log file of the segment, excluding the records that are
+ * still in the append buffer. */
+uint64_t logSegmentFileSize(struct logSegment *seg)
+{
+    return seg == logActiveSegment() ? seg->size - Log.recbuf.len : seg->size;
+}
+
+/* Time of the first message of the segment, or INT64_MAX if empty. */
+int64_t logSegmentFirstTime(struct logSegment *seg)
+{
+    return seg->count ? seg->firsttime : INT64_MAX;
+}
+
+/* A position in the log: a record offset in a segment .log file. */
+struct logCursor
+{
+    int segment;         // Index in Log.segments.
+    uint64_t offset;
+};
+
+/* Set the cursor at the index entry of 'seg' (index 'segment') from where
+ * a scan finds the first message with id >= 'id', or time >= 'ms' if 'id'
+ * is zero. Binary search of the sparse index. */
+void logSeekInSegment(struct logCursor *cur, int segment, uint64_t id,
+                      int64_t ms)
+{
+    struct logSegment *seg = Log.segments[segment];
+    int lo = 0, hi = seg->indexlen - 1, k = 0;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        int before = id ? seg->index[mid].id <= id
+                        : seg->index[mid].mstime < ms;
+        if (before)
+        {
+            k = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    cur->segment = segment;
+    cur->offset = seg->indexlen ? seg->index[k].offset : 0;
+}
+
+/* Set the cursor where a forward scan finds the first message with id
+ * >= 'id'. Binary search of the segments, then of the segment index, so
+ * this is O(log segments + log index entries). */
+void logSeekId(struct logCursor *cur, uint64_t id)
+{
+    int lo = 0, hi = Log.numsegments - 1, s = 0;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (Log.segments[mid]->firstid <= id)
+        {
+            s = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    logSeekInSegment(cur, s, id, 0);
+}
+
+/* Like logSeekId(), for the first message with time >= 'ms'. */
+void logSeekTime(struct logCursor *cur, int64_t ms)
+{
+    int lo = 0, hi = Log.numsegments - 1, s = 0;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (logSegmentFirstTime(Log.segments[mid]) < ms)
+        {
+            s = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    logSeekInSegment(cur, s, 0, ms);
+}
+
+/* Return the record at 'off' of the mapped .log file of 'seg', of 'size'
+ * bytes, or NULL if its length is not valid, logging it. Sealed segments
+ * with an index are not checked at startup, so a scan can't trust the
+ * lengths it finds: a corrupted one would loop forever or read past the
+ * mapping. The scan stops there. */
+const struct logRecord *logRecordAt(struct logSegment *seg, const char *map,
+                                    uint64_t size, uint64_t off)
+{
+    const struct logRecord *r = (const void *)(map + off);
+    if (off < size && size - off >= sizeof(*r) && r->len >= sizeof(*r) &&
+        r->len <= size - off)
+        return r;
+    fprintf(stderr, "Log segment %llu: corrupted record at offset %llu\n",
+            (unsigned long long)seg->firstid, (unsigned long long)off);
+    return NULL;
+}
+
+/* Scan the mapped .log file of 'seg', of 'size' bytes, from the record at
+ * 'off', skipping up to 'skip' messages of the room 'roomhash', and
+ * stopping at the first message with id >= 'before'. Return the offset
+ * where the scan stopped and set '*skipped' to the messages skipped. */
+uint64_t logSkipRoom(struct logSegment *seg, const char *map, uint64_t size,
+                     uint64_t off, uint64_t roomhash, uint64_t before,
+                     uint64_t skip, uint64_t *skipped)
+{
+    uint64_t n = 0;
+    while (off < size)
+    {
+        const struct logRecord *r = logRecordAt(seg, map, size, off);
+        if (r == NULL)
+        {
+            off = size;
+            break;
+        }
+        if (r->type != LOG_NAME && r->id >= before)
+            break;
+        if (r->type == LOG_ROOM_MSG && r->room == roomhash)
+        {
+            if (n == skip)
+                break;
+            n++;
+        }
+        off += r->len;
+    }
+    *skipped = n;
+    return off;
+}
+
+/* Set the cursor where a forward scan finds the last 'count' messages of
+ * the room 'roomhash' with id less than 'before'. Return how many messages
+ * the scan will find, less than 'count' if the log starts earlier.
+ *
+ * Every segment knows how many messages of the room it has, so we walk
+ * the segments backwards until enough are found, and then binary search
+ * the room index of that segment: at most LOG_ROOM_INDEX_INTERVAL
+ * messages of the room are scanned, however quiet the room is. Only the
+ * segment with 'before' in it needs a scan to count the messages. */
+int logSeekBackRoom(struct logCursor *cur, uint64_t roomhash,
+                    uint64_t before, int count)
+{
+    uint64_t need = count, skipped;
+    logSeekId(cur, before);
+    for (int s = cur->segment; s >= 0; s--)
+    {
+        struct logSegment *seg = Log.segments[s];
+        struct logRoomIndex *ri = dictFind(&seg->rooms, roomhash);
+        if (ri == NULL || ri->len == 0)
+            continue;
+        uint64_t size = logSegmentFileSize(seg);
+        uint64_t n = ri->count;
+        char *map = NULL;
+        if (before <= seg->lastid)
+        {
+            /* Count the messages up to the last entry before 'before',
+             * and scan from there for the others. */
+            int lo = 0, hi = ri->len - 1, e = -1;
+            while (lo <= hi)
+            {
+                int mid = (lo + hi) / 2;
+                if (ri->entries[mid].id < before)
+                {
+                    e = mid;
+                    lo = mid + 1;
+                }
+                else
+                {
+                    hi = mid - 1;
+                }
+            }
+            if (e == -1 || (map = logMapFile(seg->fd, size)) == NULL)
+                continue;
+            logSkipRoom(seg, map, size, ri->entries[e].offset, roomhash,
+                        before, UINT64_MAX, &skipped);
+            n = (uint64_t)e * LOG_ROOM_INDEX_INTERVAL + skipped;
+        }
+        if (n < need)
+        {
+            need -= n;
+            if (map)
+                munmap(map, size);
+            continue;
+        }
+
+        /* The first message we want is the number 'k' of the room in this
+         * segment: start from the entry before it and skip the others. */
+        uint64_t k = n - need;
+        uint64_t off = ri->entries[k / LOG_ROOM_INDEX_INTERVAL].offset;
+        if (map == NULL)
+            map = logMapFile(seg->fd, size);
+        if (map)
+        {
+            off = logSkipRoom(seg, map, size, off, roomhash, before,
+                              k % LOG_ROOM_INDEX_INTERVAL, &skipped);
+            munmap(map, size);
+        }
+        cur->segment = s;
+        cur->offset = off;
+        return count;
+    }
+    cur->segment = 0;
+    cur->offset = 0;
+    return count - need;
+}
+
+/* A range of a .dat file holding consecutive messages. */
+struct logRange
+{
+    int segment;         // Index in Log.segments.
+    uint64_t offset;
+    uint64_t len;
+};
+
+/* A scan of the messages of a room, from a cursor up to a given id. */
+struct logScan
+{
+    struct logCursor cur;   // Next record to visit.
+    uint64_t roomhash;
+    uint64_t endid;         // Stop at the first message with this id.
+    int64_t since;          // Skip messages older than this time.
+    uint64_t firstid;       // Ids of the first and last messages found,
+    uint64_t lastid;        // 0 if none yet.
+    int done;               // Set when 'endid' or the end of the log is
+                            // reached.
+};
+
+/* Find up to 'max' more messages of the scan, filling 'ranges' with at
+ * most 'max' ranges of .dat files holding them, in log order. Adjacent
+ * messages are merged in a single range, so in a busy room a long
+ * backfill is just a few ranges. Return the number of messages found, and
+ * set '*numranges'. */
+int logScanRoom(struct logScan *scan, int max, struct logRange *ranges,
+                int *numranges)
+{
+    int found = 0, len = 0;
+    while (!scan->done && found < max)
+    {
+        if (scan->cur.segment >= Log.numsegments)
+        {
+            scan->done = 1;
+            break;
+        }
+        struct logSegment *seg = Log.segments[scan->cur.segment];
+        uint64_t size = logSegmentFileSize(seg);
+        char *map = logMapFile(seg->fd, size);
+        uint64_t off = scan->cur.offset;
+        while (map && off < size && found < max)
+        {
+            const struct logRecord *r = logRecordAt(seg, map, size, off);
+            if (r == NULL)
+            {
+                off = size; // Skip the rest of the segment.
+                break;
+            }
+            if (r->type != LOG_NAME && r->id >= scan->endid)
+            {
+                scan->done = 1;
+                break;
+            }
+            off += r->len;
+            if (r->type != LOG_ROOM_MSG || r->room != scan->roomhash ||
+                r->mstime < scan->since)
+                continue;
+            struct logRange *last = len ? &ranges[len - 1] : NULL;
+            if (last && last->segment == scan->cur.segment &&
+                last->offset + last->len == r->dataoffset)
+            {
+                last->len += r->payloadlen;
+            }
+            else
+            {
+                ranges[len].segment = scan->cur.segment;
+                ranges[len].offset = r->dataoffset;
+                ranges[len].len = r->payloadlen;
+                len++;
+            }
+            if (scan->firstid == 0)
+                scan->firstid = r->id;
+            scan->lastid = r->id;
+            found++;
+        }
+        if (map)
+            munmap(map, size);
+        if (off >= size && !scan->done)
+        {
+            scan->cur.segment++;
+            scan->cur.offset = 0;
+        }
+        else
+        {
+            scan->cur.offset = off;
+        }
+    }
+    *numranges = len;
+    return found;
+}
+
+/* State used while loading a segment at startup. */
+struct logLoadState
+{
+    struct dict names;     // Name hash -> interned id + 1, for this segment.
+    uint64_t replayfrom;   // Messages before this .dat offset are not
+                           // replayed...
+    uint64_t replayid;     // ...and neither the ones before this id.
+    uint64_t end;          // Size of the valid records, see logVerify().
+    uint64_t replayed;     // Messages added to the rooms histories.
+    uint64_t dataend;      // End of the last valid message in the .dat file.
+};
+
+/* Return the interned id of a name hash defined in the segment being
+ * loaded, or -1 if unknown. */
+int logLoadName(struct logLoadState *ls, uint64_t hash)
+{
+    void *val = dictFind(&ls->names, hash);
+    return val ? (int)(intptr_t)val - 1 : -1;
+}
+
+/* Scan the valid records of the mapped segment, rebuilding its metadata
+ * and index if 'rebuild' is true, and replaying the room messages after
+ * ls->replayfrom and ls->replayid into the rooms histories. Return the
+ * offset where the scan stopped. */
+uint64_t logLoadSegment(struct logSegment *seg, const char *map,
+                        const char *data, int rebuild,
+                        struct logLoadState *ls)
+{
+    uint64_t offset = 0;
+    while (offset < ls->end)
+    {
+        const char *p = map + offset;
+        const struct logRecord *r = (const struct logRecord *)p;
+        if (r->len < sizeof(*r) || r->len > ls->end - offset)
+            break;
+
+        if (r->type == LOG_NAME)
+        {
+            if (logLoadName(ls, r->from) == -1)
+            {
+                int id = internGet(logPayload(r, data), r->payloadlen);
+                dictAdd(&ls->names, r->from, (void *)(intptr_t)(id + 1));
+            }
+        }
+        else
+        {
+            if (rebuild)
+                logSegmentTrack(seg, r, offset);
+            if (rebuild && r->type == LOG_ROOM_MSG)
+                searchIndexAdd(seg, offset, logPayload(r, data),
+                               r->payloadlen);
+            ls->dataend = r->dataoffset + r->payloadlen;
+            int room = logLoadName(ls, r->room);
+            int from = logLoadName(ls, r->from);
+            if (r->type == LOG_ROOM_MSG && room != -1)
+                logRestoreRoomSeq(room, r->seq);
+            if (r->type == LOG_ROOM_MSG && r->dataoffset >= ls->replayfrom &&
+                r->id >= ls->replayid && room != -1 && from != -1)
+            {
+                struct chunk *msg = chunkAllocSize(r->payloadlen);
+                memcpy(msg->data, logPayload(r, data), r->payloadlen);
+                msg->u.used = r->payloadlen;
+                historyAppend(roomGet(room), msg, from, r->seq);
+                chunkRelease(msg);
+                ls->replayed++;
+            }
+        }
+        offset += r->len;
+    }
+    return offset;
+}
+
+/* Release the names of a loaded segment. */
+void logLoadReleaseName(uint64_t key, void *val, void *privdata)
+{
+    (void)key;
+    (void)privdata;
+    internRelease((int)(intptr_t)val - 1);
+}
+
+void logLoadActiveName(uint64_t key, void *val, void *privdata)
+{
+    (void)val;
+    (void)privdata;
+    dictAdd(&Log.names, key, (void *)1);
+}
+
+int logCompareIds(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Return the size of the prefix of the .log file of the segment made of
+ * valid records, with the right CRC: what follows was torn by a crash,
+ * or is corrupted. Only reads the files, so that segments can be checked
+ * in parallel by logVerify(). */
+uint64_t logVerifySegment(struct logSegment *seg)
+{
+    char *map = logMapFile(seg->fd, seg->size);
+    char *data = logMapFile(seg->datafd, seg->datasize);
+    uint64_t offset = 0;
+    while (map && offset < seg->size &&
+           logRecordIsValid(map + offset, seg->size - offset, data,
+                            seg->datasize))
+        offset += ((const struct logRecord *)(map + offset))->len;
+    if (map)
+        munmap(map, seg->size);
+    if (data)
+        munmap(data, seg->datasize);
+    return offset;
+}
+
+/* Segments to check at startup, shared by the verification threads. */
+struct logVerifyJob
+{
+    struct logSegment **segments;
+    uint64_t *valid;       // Result of logVerifySegment() for every segment.
+    int count;
+    int next;              // Next segment to check, taken atomically.
+};
+
+void *logVerifyThread(void *arg)
+{
+    struct logVerifyJob *job = arg;
+    int j;
+    while ((j = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+           job->count)
+        job->valid[j] = logVerifySegment(job->segments[j]);
+    return NULL;
+}
+
+/* Check the CRCs of 'count' segments, setting 'valid', using a thread per
+ * CPU (up to LOG_VERIFY_THREADS): segments are independent, and checking
+ * them is what costs most at startup. Return the number of threads. */
+int logVerify(struct logSegment **segments, int count, uint64_t *valid)
+{
+    struct logVerifyJob job = {segments, valid, count, 0};
+    pthread_t threads[LOG_VERIFY_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int numthreads = count < cpus ? count : cpus;
+    if (numthreads > LOG_VERIFY_THREADS)
+        numthreads = LOG_VERIFY_THREADS;
+    crc32(0, NULL, 0); // Compute the table before the threads share it.
+    int started = 0;
+    while (started < numthreads - 1 &&
+           pthread_create(&threads[started], NULL, logVerifyThread,
+                          &job) == 0)
+        started++;
+    logVerifyThread(&job); // This thread does its part too.
+    for (int j = 0; j < started; j++)
+        pthread_join(threads[j], NULL);
+    return started + 1;
+}
+
+/* Open the log in 'dir', creating the directory if needed. Sealed segments
+ * are loaded from their .idx files, and the others are scanned. Then the
+ * messages of the tail of the log are replayed into the rooms histories:
+ * the ones from 'replayid' on, when the histories were loaded from a
+ * snapshot, otherwise the last LOG_REPLAY_BYTES. Segments with records
+ * to scan are checked first, in parallel, and truncated at the first
+ * record torn by a crash or corrupted. */
+void logInit(const char *dir, uint64_t replayid)
+{
+    int64_t start = ustime();
+    Log.dir = strdup(dir);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        perror("Creating the log directory");
+        exit(1);
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        perror("Opening the log directory");
+        exit(1);
+    }
+
+    /* Collect the segments ids from the file names. */
+    uint64_t *ids = NULL;
+    int numids = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+        char *dot = strchr(de->d_name, '.');
+        if (dot == NULL || strcmp(dot, ".log") != 0)
+            continue;
+        ids = chatRealloc(ids, sizeof(uint64_t) * (numids + 1));
+        ids[numids++] = strtoull(de->d_name, NULL, 10);
+    }
+    closedir(d);
+    qsort(ids, numids, sizeof(uint64_t), logCompareIds);
+
+    /* Open them, and figure out where the replay should start. */
+    uint64_t total = 0;
+    for (int j = 0; j < numids; j++)
+        total += logOpenSegment(ids[j], 0)->datasize;
+    free(ids);
+
+    /* Load the indexes of the sealed segments, and select the segments to
+     * scan: the ones without a valid index, and the ones to replay. */
+    uint64_t replaystart = total > LOG_REPLAY_BYTES && !replayid ?
+                           total - LOG_REPLAY_BYTES : 0;
+    struct logSegment **scan = chatMalloc(sizeof(*scan) *
+                                          (Log.numsegments + 1));
+    uint64_t *valid = chatMalloc(sizeof(*valid) * (Log.numsegments + 1));
+    int *rebuild = chatMalloc(sizeof(int) * (Log.numsegments + 1));
+    int numscan = 0;
+    uint64_t segstart = 0, verified = 0;
+    for (int j = 0; j < Log.numsegments; j++)
+    {
+        struct logSegment *seg = Log.segments[j];
+        int active = j == Log.numsegments - 1;
+        rebuild[j] = active || logLoadIndex(seg) == -1 ||
+                     searchIndexLoad(seg) == -1;
+        int replay = segstart + seg->datasize > replaystart &&
+                     (active || Log.segments[j + 1]->firstid > replayid);
+        segstart += seg->datasize;
+        if (rebuild[j] || replay)
+        {
+            scan[numscan++] = seg;
+            verified += seg->size + seg->datasize;
+        }
+    }
+    int64_t indexed = ustime();
+    int threads = logVerify(scan, numscan, valid);
+    int64_t checked = ustime();
+
+    uint64_t replayed = 0;
+    segstart = 0;
+    for (int j = 0, k = 0; j < Log.numsegments; j++)
+    {
+        struct logSegment *seg = Log.segments[j];
+        int active = j == Log.numsegments - 1;
+        if (k < numscan && scan[k] == seg)
+        {
+            if (rebuild[j])
+            {
+                seg->indexlen = 0; // Maybe loaded from an .idx file.
+                dictEmpty(&seg->rooms, logRoomIndexFree, NULL);
+                seg->count = 0;
+                seg->lastid = seg->firstid - 1;
+            }
+            struct logLoadState ls;
+            memset(&ls, 0, sizeof(ls));
+            ls.replayfrom = replaystart > segstart ?
+                            replaystart - segstart : 0;
+            ls.replayid = replayid;
+            ls.end = valid[k++];
+            char *map = logMapFile(seg->fd, seg->size);
+            char *data = logMapFile(seg->datafd, seg->datasize);
+            uint64_t loaded = map ?
+                logLoadSegment(seg, map, data, rebuild[j], &ls) : 0;
+            if (map)
+                munmap(map, seg->size);
+            if (data)
+                munmap(data, seg->datasize);
+            if (loaded != seg->size || ls.dataend != seg->datasize)
+            {
+                fprintf(stderr, "Log segment %llu: truncating %llu+%llu "
+                        "bytes of incomplete or corrupted records\n",
+                        (unsigned long long)seg->firstid,
+                        (unsigned long long)(seg->size - loaded),
+                        (unsigned long long)(seg->datasize - ls.dataend));
+                if (ftruncate(seg->fd, loaded) == -1 ||
+                    ftruncate(seg->datafd, ls.dataend) == -1)
+                {
+                    perror("Truncating log segment");
+                    exit(1);
+                }
+                seg->size = loaded;
+                seg->datasize = ls.dataend;
+            }
+            if (active) // Remember which names the active segment defines.
+                dictForEach(&ls.names, logLoadActiveName, NULL);
+            if (rebuild[j] && !active)
+            {
+                logSeal(seg);
+            }
+            dictEmpty(&ls.names, logLoadReleaseName, NULL);
+            replayed += ls.replayed;
+        }
+        segstart += seg->datasize;
+        if (seg->lastid >= Log.nextid)
+            Log.nextid = seg->lastid + 1;
+    }
+    free(scan);
+    free(valid);
+    free(rebuild);
+
+    if (Log.numsegments == 0)
+        logOpenSegment(Log.nextid, 1);
+    int64_t end = ustime();
+    printf("Message log: %d segments, %llu bytes, next id %llu, "
+           "%llu messages replayed in %lld ms (indexes %lld ms, "
+           "CRC check of %llu MB with %d threads %lld ms, "
+           "scan and replay %lld ms)\n",
+           Log.numsegments, (unsigned long long)segstart,
+           (unsigned long long)Log.nextid, (unsigned long long)replayed,
+           (long long)(end - start) / 1000,
+           (long long)(indexed - start) / 1000,
+           (unsigned long long)verified / (1024 * 1024), threads,
+           (long long)(checked - indexed) / 1000,
+           (long long)(end - checked) / 1000);
+}
+
+/* ============================ Offline messages ================================
+ * A DM sent to a nick nobody is using is not lost: it waits in a queue for
+ * that nick, and is delivered as soon as a client takes the nick. Queues
+ * are keyed by the hash of the nick, since nobody holds the nick interned
+ * while its owner is away.
+ *
+ * Every queue is bounded in number of messages and bytes, and messages
+ * expire after OFFLINE_TTL seconds. With the message log enabled the DM is
+ * already on disk, so the queue just remembers where: pending messages
+ * cost a few bytes of memory each, and are read back only on delivery.
+ * Without the log the message itself is kept, up to OFFLINE_MEMORY bytes
+ * for all the queues.
+ *
+ * Since anybody can DM any nick, the queues are also bounded as a whole:
+ * at most OFFLINE_MAX_QUEUES absent nicks and OFFLINE_MAX_ENTRIES
+ * messages, and the messages in the log at most OFFLINE_DISK bytes. Past
+ * that, new DMs to absent nicks are refused.
+ * =========================================================================== */
+
+#define OFFLINE_MAX_MSGS 100          // DMs kept for every absent nick...
+#define OFFLINE_MAX_BYTES (64*1024)   // ...as long as they fit in this size.
+#define OFFLINE_TTL (7*24*3600)       // Seconds an undelivered DM is kept.
+#define OFFLINE_MEMORY (4*1024*1024)  // Max bytes of DMs kept in memory.
+#define OFFLINE_MAX_QUEUES 100000     // Max absent nicks with DMs queued.
+#define OFFLINE_MAX_ENTRIES 1000000   // Max DMs queued for all the nicks.
+#define OFFLINE_DISK (1024*1024*1024) // Max bytes of queued DMs in the log.
+
+struct offlineMsg
+{
+    struct offlineMsg *next;
+    time_t ctime;            // When the DM was sent.
+    size_t len;
+    struct chunk *msg;       // The DM, or NULL if it is read from the log:
+    int segment;             // index of the segment in Log.segments and
+    uint64_t offset;         // offset in its .dat file.
+};
+
+struct offlineQueue
+{
+    struct offlineMsg *head, *tail; // Oldest first.
+    int count;
+    size_t bytes;
+};
+
+struct offlineState
+{
+    struct dict queues;      // Nick hash -> struct offlineQueue.
+    size_t memory;           // Bytes of the messages kept in memory.
+    size_t logged;           // Bytes of the messages read from the log.
+    uint64_t entries;        // Messages in all the queues.
+    uint64_t queued, delivered, expired, refused, skipped;
+};
+
+struct offlineState Offline;
+
+/* Return true if a DM of 'len' bytes for the nick 'nickhash' can be
+ * queued without exceeding the limits. 'logged' is true if the DM is in
+ * the log, see offlineQueueAdd(). */
+int offlineCanQueue(uint64_t nickhash, size_t len, int logged)
+{
+    struct offlineQueue *q = dictFind(&Offline.queues, nickhash);
+    if (q && (q->count >= OFFLINE_MAX_MSGS ||
+              q->bytes + len > OFFLINE_MAX_BYTES))
+        return 0;
+    if ((q == NULL && Offline.queues.used >= OFFLINE_MAX_QUEUES) ||
+        Offline.entries >= OFFLINE_MAX_ENTRIES)
+        return 0;
+    if (logged && Log.dir)
+        return Offline.logged + len <= OFFLINE_DISK;
+    return Offline.memory + len <= OFFLINE_MEMORY;
+}
+
+/* Append an entry for a DM of 'len' bytes to the queue of 'nickhash',
+ * creating the queue if needed. The caller sets where the DM is. */
+struct offlineMsg *offlineQueueLink(uint64_t nickhash, size_t len)
+{
+    struct offlineQueue *q = dictFind(&Offline.queues, nickhash);
+    if (q == NULL)
+    {
+        q = chatMalloc(sizeof(*q));
+        memset(q, 0, sizeof(*q));
+        dictAdd(&Offline.queues, nickhash, q);
+    }
+    struct offlineMsg *m = chatMalloc(sizeof(*m));
+    m->next = NULL;
+    m->ctime = Clock.unixtime;
+    m->len = len;
+    m->msg = NULL;
+    if (q->tail)
+        q->tail->next = m;
+    else
+        q->head = m;
+    q->tail = m;
+    q->count++;
+    q->bytes += len;
+    Offline.entries++;
+    Offline.queued++;
+    return m;
+}
+
+/* Queue the DM 'dm' for the nick 'nickhash'. If 'logged' is true the DM
+ * must have just been passed to logAppend(), otherwise it is kept in
+ * memory. offlineCanQueue() must have returned true. */
+void offlineQueueAdd(uint64_t nickhash, struct chunk *dm, int logged)
+{
+    struct offlineMsg *m = offlineQueueLink(nickhash, dm->u.used);
+    if (!logged || logLastMessage(m->len, &m->segment, &m->offset) == -1)
+    {
+        chunkRetain(dm);
+        m->msg = dm;
+        Offline.memory += m->len;
+    }
+    else
+    {
+        Offline.logged += m->len;
+    }
+}
+
+void offlineMsgFree(struct offlineMsg *m)
+{
+    if (m->msg)
+    {
+        Offline.memory -= m->len;
+        chunkRelease(m->msg);
+    }
+    else
+    {
+        Offline.logged -= m->len;
+    }
+    Offline.entries--;
+    free(m);
+}
+
+/* Remove the queue of 'nickhash' and return its messages in a single
+ * chunk, or NULL if there are none. Messages that can't be read back from
+ * the log are skipped, so the header line telling how many messages
+ * follow is only written once they are all read. */
+struct chunk *offlineTake(uint64_t nickhash)
+{
+    struct offlineQueue *q = dictFind(&Offline.queues, nickhash);
+    if (q == NULL)
+        return NULL;
+    dictDelete(&Offline.queues, nickhash);
+    /* A DM queued in this same event loop iteration may still be in the
+     * log buffers: the files must have it before we read it back. */
+    logFlush();
+    char header[64];
+    struct chunk *ch = chunkAllocSize(sizeof(header) + q->bytes);
+    ch->u.used = 0;
+    int count = 0;
+    while (q->head)
+    {
+        struct offlineMsg *m = q->head;
+        q->head = m->next;
+        char *dst = ch->data + ch->u.used;
+        if (m->msg)
+        {
+            memcpy(dst, m->msg->data, m->len);
+            ch->u.used += m->len;
+        }
+        else if (pread(Log.segments[m->segment]->datafd, dst, m->len,
+                       m->offset) == (ssize_t)m->len)
+        {
+            ch->u.used += m->len;
+        }
+        else
+        {
+            Offline.skipped++;
+            offlineMsgFree(m);
+            continue;
+        }
+        count++;
+        Offline.delivered++;
+        offlineMsgFree(m);
+    }
+    free(q);
+    if (count == 0)
+    {
+        chunkRelease(ch);
+        return NULL;
+    }
+    int headerlen = snprintf(header, sizeof(header),
+                             "You have %d offline messages:\n", count);
+    memmove(ch->data + headerlen, ch->data, ch->u.used);
+    memcpy(ch->data, header, headerlen);
+    ch->u.used += headerlen;
+    return ch;
+}
+
+/* State of an expire cycle. */
+struct offlineExpire
+{
+    time_t now;
+    uint64_t *empty;         // Queues left empty, deleted after the visit.
+    int numempty;
+};
+
+/* Drop the expired messages of a queue. Messages are queued in time
+ * order, so only the head needs to be checked. */
+void offlineExpireQueue(uint64_t key, void *val, void *privdata)
+{
+    struct offlineQueue *q = val;
+    struct offlineExpire *ex = privdata;
+    while (q->head && ex->now - q->head->ctime >= OFFLINE_TTL)
+    {
+        struct offlineMsg *m = q->head;
+        q->head = m->next;
+        if (q->head == NULL)
+            q->tail = NULL;
+        q->count--;
+        q->bytes -= m->len;
+        Offline.expired++;
+        offlineMsgFree(m);
+    }
+    if (q->head == NULL)
+    {
+        ex->empty = chatRealloc(ex->empty,
+                                sizeof(uint64_t) * (ex->numempty + 1));
+        ex->empty[ex->numempty++] = key;
+    }
+}
+
+/* Called periodically: expire old messages and free the empty queues. */
+void offlineCron(time_t now)
+{
+    struct offlineExpire ex = {now, NULL, 0};
+    dictForEach(&Offline.queues, offlineExpireQueue, &ex);
+    for (int j = 0; j < ex.numempty; j++)
+    {
+        free(dictFind(&Offline.queues, ex.empty[j]));
+        dictDelete(&Offline.queues, ex.empty[j]);
+    }
+    free(ex.empty);
+}
+
+/* ============================= Acknowledged DMs ===============================
+ * DMs are normally written to the socket and forgotten: if the connection
+ * drops before the client reads them, they are lost. Clients that need
+ * more, like bots, send /ack on: from then on every DM they get carries an
+ * id, "DM <id> from <nick>: ...", and is kept in a window of unacknowledged
+ * messages until the client sends /ack <id>. Acks are cumulative, one
+ * /ack acknowledges every DM up to that id, so a client can ack a batch at
+ * a time.
+ *
+ * There are no per-message timers: once per second serverCron() checks
+ * just the oldest message of every window, and if it waited for its ack
+ * more than ACK_TIMEOUT seconds the whole window is sent again. The window
+ * follows the client session (see "Sessions") and is sent again as soon as
+ * the session is restored. The result is at-least-once delivery: clients
+ * must ignore ids they already saw.
+ *
+ * The window is bounded: when it is full, DMs for the client are refused,
+ * and the sender is told so.
+ * =========================================================================== */
+
+#define ACK_WINDOW 64              // Max unacknowledged DMs per client...
+#define ACK_WINDOW_BYTES (64*1024) // ...as long as they fit in this size.
+#define ACK_TIMEOUT 5              // Seconds before sending them again.
+
+struct ackEntry
+{
+    uint64_t id;
+    struct chunk *msg;             // The DM, id included.
+};
+
+struct ackWindow
+{
+    struct ackEntry entries[ACK_WINDOW];
+    int first;                     // Index of the oldest entry.
+    int count;                     // Number of entries.
+    size_t bytes;                  // Total size of the messages.
+    uint64_t nextid;               // Id of the next DM.
+    time_t sent;                   // When the oldest DM was last sent.
+};
+
+struct ackState
+{
+    uint64_t acked, retransmitted, refused, dropped;
+};
+
+struct ackState Acks;
+
+struct ackWindow *ackWindowCreate(void)
+{
+    struct ackWindow *w = chatMalloc(sizeof(*w));
+    memset(w, 0, sizeof(*w));
+    w->nextid = 1;
+    return w;
+}
+
+/* Return true if a DM of 'len' bytes fits in the window. */
+int ackWindowHasRoom(struct ackWindow *w, size_t len)
+{
+    return w->count < ACK_WINDOW && w->bytes + len <= ACK_WINDOW_BYTES;
+}
+
+/* Write in 'buf' the prefix of the DM with id 'id', and return its
+ * length. */
+int ackPrefix(char *buf, size_t size, uint64_t id)
+{
+    return snprintf(buf, size, "DM %llu ", (unsigned long long)id);
+}
+
+/* Format the DM 'text' of 'len' bytes (without the "DM " prefix the other
+ * clients get, see handleDirectMessage()) with the next id of the window,
+ * and remember it. Return the formatted DM, with a reference
+ * owned by the window. ackWindowHasRoom() must have returned true. */
+struct chunk *ackWindowAdd(struct ackWindow *w, const char *text, size_t len)
+{
+    char prefix[32];
+    int prefixlen = ackPrefix(prefix, sizeof(prefix), w->nextid);
+    struct chunk *msg = chunkAllocSize(prefixlen + len);
+    memcpy(msg->data, prefix, prefixlen);
+    memcpy(msg->data + prefixlen, text, len);
+    msg->u.used = msg->size;
+
+    struct ackEntry *e = w->entries + (w->first + w->count) % ACK_WINDOW;
+    e->id = w->nextid++;
+    e->msg = msg;
+    if (w->count == 0)
+        w->sent = Clock.unixtime;
+    w->count++;
+    w->bytes += msg->u.used;
+    return msg;
+}
+
+/* Drop the oldest entry of the window. */
+void ackWindowPop(struct ackWindow *w)
+{
+    struct ackEntry *e = w->entries + w->first;
+    w->bytes -= e->msg->u.used;
+    chunkRelease(e->msg);
+    w->first = (w->first + 1) % ACK_WINDOW;
+    w->count--;
+}
+
+/* Process the cumulative ack 'id': every DM up to it was received. Return
+ * the number of DMs acknowledged. */
+int ackWindowAck(struct ackWindow *w, uint64_t id)
+{
+    int acked = 0;
+    while (w->count && w->entries[w->first].id <= id)
+    {
+        ackWindowPop(w);
+        acked++;
+    }
+    /* The new oldest DM may have been sent long ago, but its timeout
+     * starts now: it was sent after those just acknowledged, so it is
+     * likely in flight. */
+    w->sent = Clock.unixtime;
+    Acks.acked += acked;
+    return acked;
+}
+
+/* Free the window. The DMs never acknowledged go to the offline queue of
+ * 'nickhash', so whoever takes the nick next gets them, if they fit. They
+ * are queued without the id, as any other DM: the id belongs to this
+ * window, and whoever takes the nick may not use acks at all. */
+void ackWindowFree(struct ackWindow *w, uint64_t nickhash)
+{
+    while (w->count)
+    {
+        struct ackEntry *e = w->entries + w->first;
+        char prefix[32];
+        size_t skip = ackPrefix(prefix, sizeof(prefix), e->id) - 3;
+        size_t len = e->msg->u.used - skip;
+        if (offlineCanQueue(nickhash, len, 0))
+        {
+            struct chunk *dm = chunkAllocSize(len);
+            memcpy(dm->data, "DM ", 3);
+            memcpy(dm->data + 3, e->msg->data + skip + 3, len - 3);
+            dm->u.used = len;
+            offlineQueueAdd(nickhash, dm, 0);
+            chunkRelease(dm);
+        }
+        else
+        {
+            Acks.dropped++;
+        }
+        ackWindowPop(w);
+    }
+    free(w);
+}
+
+/* ================================= Sessions ===================================
+ * Every connection gets a session, identified by a random token sent to the
+ * client with the welcome message. When the connection drops, the session
+ * remembers the nick, the joined rooms and the sequence number of the last
+ * message the client received in each of them, for SESSION_GRACE seconds.
+ * A client reconnecting within that time sends /session <token> and is back
+ * where it was, getting only the messages it missed, instead of setting its
+ * nick, joining its rooms and fetching their history again: on mobile
+ * networks, where connections drop all the time, this is most of the load.
+ *
+ * Sessions are found by token with a hash table lookup. Detached sessions
+ * are also linked in a list in detach order, so expiring them only looks
+ * at the ones that actually expired.
+ * =========================================================================== */
+
+#define SESSION_TOKEN_LEN 16 // Random bytes of a token, sent as hex.
+#define SESSION_GRACE 120    // Seconds a session outlives its connection.
+
+struct session
+{
+    unsigned char token[SESSION_TOKEN_LEN];
+    struct client *c;             // The client, or NULL if detached.
+    struct session *prev, *next;  // Detached sessions list.
+    time_t detached;              // When the client disconnected.
+    int nick;                     // What the client had when it left:
+    int room;                     // nick, current room, joined rooms and
+    int *rooms;                   // last sequence number received in every
+    uint64_t *seen;               // room.
+    int numrooms;
+    struct ackWindow *acks;       // And the DMs it did not acknowledge.
+};
+
+struct sessionState
+{
+    struct dict table;            // First 8 token bytes -> struct session.
+    struct session *head, *tail;  // Detached sessions, oldest first.
+    uint64_t created, restored, expired;
+};
+
+struct sessionState Sessions;
+
+/* The hash table key of a token. Tokens are random, any 8 bytes will do. */
+uint64_t sessionKey(const unsigned char *token)
+{
+    uint64_t key;
+    memcpy(&key, token, sizeof(key));
+    return key;
+}
+
+/* Create a new session for the client 'c', with a token nobody else has. */
+struct session *sessionCreate(struct client *c)
+{
+    struct session *s = chatMalloc(sizeof(*s));
+    memset(s, 0, sizeof(*s));
+    do
+    {
+        if (getrandom(s->token, SESSION_TOKEN_LEN, 0) != SESSION_TOKEN_LEN)
+        {
+            perror("getrandom");
+            exit(1);
+        }
+    } while (dictFind(&Sessions.table, sessionKey(s->token)));
+    dictAdd(&Sessions.table, sessionKey(s->token), s);
+    s->c = c;
+    s->nick = -1;
+    s->room = -1;
+    Sessions.created++;
+    return s;
+}
+
+/* Write the token of the session in 'buf' as a null terminated hex string.
+ * 'buf' must have room for SESSION_TOKEN_LEN*2+1 bytes. */
+void sessionToken(struct session *s, char *buf)
+{
+    for (int j = 0; j < SESSION_TOKEN_LEN; j++)
+        snprintf(buf + j * 2, 3, "%02x", s->token[j]);
+}
+
+/* Replace the token of the session. Used when a session comes from
+ * another process, see "Live upgrade". */
+void sessionSetToken(struct session *s, const unsigned char *token)
+{
+    dictDelete(&Sessions.table, sessionKey(s->token));
+    memcpy(s->token, token, SESSION_TOKEN_LEN);
+    dictAdd(&Sessions.table, sessionKey(s->token), s);
+}
+
+/* Add a session that was just detached at the end of the list of detached
+ * sessions, starting its grace period. */
+void sessionLink(struct session *s, time_t detached)
+{
+    s->detached = detached;
+    s->prev = Sessions.tail;
+    if (Sessions.tail)
+        Sessions.tail->next = s;
+    else
+        Sessions.head = s;
+    Sessions.tail = s;
+}
+
+/* Remove a detached session from the list of detached sessions. */
+void sessionUnlink(struct session *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        Sessions.head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    else
+        Sessions.tail = s->prev;
+    s->prev = s->next = NULL;
+}
+
+/* Release the state saved when the session was detached. */
+void sessionClear(struct session *s)
+{
+    if (s->acks)
+        ackWindowFree(s->acks, internHash(s->nick));
+    s->acks = NULL;
+    if (s->nick != -1)
+        internRelease(s->nick);
+    for (int j = 0; j < s->numrooms; j++)
+        internRelease(s->rooms[j]);
+    free(s->rooms);
+    free(s->seen);
+    s->nick = s->room = -1;
+    s->rooms = NULL;
+    s->seen = NULL;
+    s->numrooms = 0;
+}
+
+/* Called when the client is freed, or its session is taken over by
+ * another connection: save its state in the session and start the grace
+ * period. */
+void sessionDetach(struct client *c)
+{
+    struct session *s = c->session;
+    if (s == NULL)
+        return;
+    internRetain(c->nick);
+    s->nick = c->nick;
+    s->room = c->room;
+    s->numrooms = c->numrooms;
+    s->rooms = chatMalloc(sizeof(int) * c->numrooms);
+    s->seen = chatMalloc(sizeof(uint64_t) * c->numrooms);
+    for (int j = 0; j < c->numrooms; j++)
+    {
+        internRetain(c->rooms[j]);
+        s->rooms[j] = c->rooms[j];
+        s->seen[j] = c->seen[j];
+    }
+    s->acks = c->acks;
+    c->acks = NULL;
+    s->c = NULL;
+    c->session = NULL;
+    sessionLink(s, Clock.unixtime);
+}
+
+/* Return true unless the client is only waiting to be freed before the
+ * next poll(): it timed out, went over its output limit, or its session
+ * was taken over by another connection, that detached it. Such clients
+ * must not be handed to anybody else. */
+int clientIsLive(struct client *c)
+{
+    return !(c->flags & CLIENT_CLOSE_ASAP) && c->session != NULL;
+}
+
+/* Destroy the session. */
+void sessionFree(struct session *s)
+{
+    if (s->c)
+        s->c->session = NULL;
+    else
+        sessionUnlink(s);
+    sessionClear(s);
+    dictDelete(&Sessions.table, sessionKey(s->token));
+    free(s);
+}
+
+/* Return the session with the given hex token, or NULL if there is no
+ * such session or its grace period is over. */
+struct session *sessionFind(const char *hex)
+{
+    unsigned char token[SESSION_TOKEN_LEN];
+    if (strlen(hex) != SESSION_TOKEN_LEN * 2)
+        return NULL;
+    for (int j = 0; j < SESSION_TOKEN_LEN; j++)
+    {
+        unsigned int byte;
+        if (sscanf(hex + j * 2, "%2x", &byte) != 1)
+            return NULL;
+        token[j] = byte;
+    }
+    struct session *s = dictFind(&Sessions.table, sessionKey(token));
+    if (s == NULL || memcmp(s->token, token, SESSION_TOKEN_LEN) != 0)
+        return NULL;
+    if (s->c == NULL && Clock.unixtime - s->detached >= SESSION_GRACE)
+        return NULL; // Expired, sessionCron() did not free it yet.
+    return s;
+}
+
+/* Called periodically: free the sessions whose grace period is over. */
+void sessionCron(time_t now)
+{
+    while (Sessions.head && now - Sessions.head->detached >= SESSION_GRACE)
+    {
+        sessionFree(Sessions.head);
+        Sessions.expired++;
+    }
+}
+
+/* ================================= Search =====================================
+ * /search <words> [#room] finds the most recent room messages containing
+ * all the words, using the search index of the log segments.
+ *
+ * Queries run in the background threads. The event loop only collects
+ * what they need: the descriptors of the segment files, the mapped .sdx
+ * files of the sealed segments, that never change, and a copy of the
+ * posting lists of the query words in the active segment, whose index
+ * keeps changing. The threads then intersect the posting lists and read
+ * the matching messages with pread(), without touching the chat state.
+ * =========================================================================== */
+
+#define SEARCH_MAX_TERMS 8       // Words of a query we consider.
+#define SEARCH_MAX_RESULTS 20    // The most recent matches are returned.
+
+struct searchSegment
+{
+    int fd, datafd;          // The segment files.
+    uint64_t size;           // Bytes of the .log file to consider.
+    const char *sdx;         // The mapped index, or NULL for the active
+                             // segment, in which case these are copies
+                             // of the posting lists:
+    unsigned char *postings[SEARCH_MAX_TERMS];
+    size_t postinglen[SEARCH_MAX_TERMS];
+};
+
+struct searchJob
+{
+    struct client *c;        // NULL if the client disconnected meanwhile.
+    uint64_t terms[SEARCH_MAX_TERMS]; // Hashes of the words.
+    int numterms;
+    uint64_t roomhash;       // Only search this room, 0 for all.
+    struct searchSegment *segments; // Newest first.
+    int numsegments;
+    int64_t start;           // When the query was submitted.
+    int64_t evaltime;        // Microseconds spent evaluating it.
+    char *reply;             // Results, ready to be sent.
+    size_t replylen;
+};
+
+/* Decode a posting list into an array of record offsets, setting '*count'.
+ * The caller frees the array. */
+uint64_t *searchDecode(const unsigned char *p, size_t len, size_t *count)
+{
+    const unsigned char *end = p + len;
+    uint64_t *offsets = chatMalloc(sizeof(uint64_t) * (len + 1));
+    uint64_t cur = 0, delta;
+    size_t n = 0;
+    while (p < end && varintGet(&p, end, &delta) == 0)
+    {
+        cur += delta;
+        offsets[n++] = cur * 8;
+    }
+    *count = n;
+    return offsets;
+}
+
+/* Keep in a[] only the offsets also in b[]. Both are sorted. Return the
+ * new length of a[]. */
+size_t searchIntersect(uint64_t *a, size_t alen, const uint64_t *b,
+                       size_t blen)
+{
+    size_t i = 0, j = 0, n = 0;
+    while (i < alen && j < blen)
+    {
+        if (a[i] < b[j])
+            i++;
+        else if (a[i] > b[j])
+            j++;
+        else
+        {
+            a[n++] = a[i];
+            i++;
+            j++;
+        }
+    }
+    return n;
+}
+
+/* Append to the reply the message of the record at 'offset', if it is a
+ * message of the room we are looking for. Return 1 if it was added. */
+int searchAddResult(struct searchJob *job, struct searchSegment *s,
+                    uint64_t offset)
+{
+    struct logRecord r;
+    if (pread(s->fd, &r, sizeof(r), offset) != sizeof(r) ||
+        r.type != LOG_ROOM_MSG || (job->roomhash && r.room != job->roomhash))
+        return 0;
+    char prefix[32];
+    int prefixlen = snprintf(prefix, sizeof(prefix), "id:%llu ",
+                             (unsigned long long)r.id);
+    job->reply = chatRealloc(job->reply,
+                             job->replylen + prefixlen + r.payloadlen);
+    char *dst = job->reply + job->replylen;
+    memcpy(dst, prefix, prefixlen);
+    if (pread(s->datafd, dst + prefixlen, r.payloadlen, r.dataoffset) !=
+        (ssize_t)r.payloadlen)
+        return 0;
+    job->replylen += prefixlen + r.payloadlen;
+    return 1;
+}
+
+/* Runs in a background thread: find the most recent messages having all
+ * the words, newest segment first, and format the reply. */
+void searchWork(void *arg)
+{
+    struct searchJob *job = arg;
+    int64_t start = ustime();
+    int found = 0;
+    for (int j = 0; j < job->numsegments && found < SEARCH_MAX_RESULTS; j++)
+    {
+        struct searchSegment *s = &job->segments[j];
+        uint64_t *matches = NULL;
+        size_t nmatches = 0;
+        for (int t = 0; t < job->numterms; t++)
+        {
+            size_t len = 0;
+            const unsigned char *p = s->postings[t];
+            if (s->sdx)
+                p = searchFileLookup(s->sdx, job->terms[t], &len);
+            else
+                len = s->postinglen[t];
+            if (p == NULL)
+            {
+                nmatches = 0;
+                break;
+            }
+            size_t count;
+            uint64_t *offsets = searchDecode(p, len, &count);
+            if (matches == NULL)
+            {
+                matches = offsets;
+                nmatches = count;
+            }
+            else
+            {
+                nmatches = searchIntersect(matches, nmatches, offsets, count);
+                free(offsets);
+            }
+            if (nmatches == 0)
+                break;
+        }
+
+        /* The most recent matches are at the end. Results are collected
+         * newest first, and the order is fixed when sending them. */
+        for (size_t k = nmatches; k > 0 && found < SEARCH_MAX_RESULTS; k--)
+            if (matches[k - 1] < s->size)
+                found += searchAddResult(job, s, matches[k - 1]);
+        free(matches);
+    }
+    job->evaltime = ustime() - start;
+
+    /* Reverse the order of the lines, so the oldest result comes first. */
+    char *sorted = chatMalloc(job->replylen + 128);
+    size_t end = job->replylen, len = 0;
+    while (end)
+    {
+        size_t start = end - 1;
+        while (start && job->reply[start - 1] != '\n')
+            start--;
+        memcpy(sorted + len, job->reply + start, end - start);
+        len += end - start;
+        end = start;
+    }
+    free(job->reply);
+    job->reply = sorted;
+    job->replylen = len;
+}
+
+/* =========================== State serialization ==============================
+ * The state that outlives connections (rooms with their history, sessions,
+ * offline DMs) can be serialized into a buffer and loaded back, to move it
+ * to another process (see "Live upgrade") or save it to disk (see
+ * "Snapshots"). The format is a plain sequence of 64 bit integers and
+ * length prefixed strings, in native byte order: it is only read on the
+ * machine that wrote it. Names are saved as strings, since interned ids
+ * mean nothing to another process.
+ * =========================================================================== */
+
+/* Reads serialized state, failing gracefully on truncated input. */
+struct stateReader
+{
+    const char *p;
+    size_t left;
+    int err;    // Set when reading past the end.
+};
+
+void statePutU64(struct logBuffer *b, uint64_t v)
+{
+    logBufferAppend(b, &v, sizeof(v));
+}
+
+void statePutStr(struct logBuffer *b, const char *p, size_t len)
+{
+    statePutU64(b, len);
+    logBufferAppend(b, p, len);
+}
+
+/* Serialize the content of a chunk buffer, reading back the ranges of
+ * files it references. */
+void statePutBuf(struct logBuffer *b, struct chunkBuf *cb)
+{
+    size_t lenpos = b->len;
+    statePutU64(b, 0); // Patched below, file reads may come up short.
+    for (struct bufNode *n = cb->head; n; n = n->next)
+    {
+        size_t len = n->end - n->start;
+        if (n->chunk->class != CHUNK_FILE)
+        {
+            logBufferAppend(b, n->chunk->data + n->start, len);
+            continue;
+        }
+        if (b->len + len > b->cap)
+        {
+            b->cap = (b->len + len) * 2;
+            b->p = chatRealloc(b->p, b->cap);
+        }
+        ssize_t nread = pread(n->chunk->u.fd, b->p + b->len, len, n->start);
+        if (nread > 0)
+            b->len += nread;
+    }
+    uint64_t len = b->len - lenpos - sizeof(uint64_t);
+    memcpy(b->p + lenpos, &len, sizeof(len));
+}
+
+uint64_t stateGetU64(struct stateReader *rd)
+{
+    uint64_t v = 0;
+    if (rd->left < sizeof(v))
+    {
+        rd->err = 1;
+        rd->left = 0;
+        return 0;
+    }
+    memcpy(&v, rd->p, sizeof(v));
+    rd->p += sizeof(v);
+    rd->left -= sizeof(v);
+    return v;
+}
+
+/* Return a pointer to the next string, not null terminated, setting
+ * '*len'. On errors the string is empty. */
+const char *stateGetStr(struct stateReader *rd, size_t *len)
+{
+    *len = stateGetU64(rd);
+    if (*len > rd->left)
+    {
+        rd->err = 1;
+        rd->left = 0;
+    }
+    if (rd->err)
+    {
+        *len = 0;
+        return "";
+    }
+    const char *p = rd->p;
+    rd->p += *len;
+    rd->left -= *len;
+    return p;
+}
+
+/* Return the interned id of the next string, with a reference owned by
+ * the caller. */
+int stateGetIntern(struct stateReader *rd)
+{
+    size_t len;
+    const char *p = stateGetStr(rd, &len);
+    return internGet(p, len);
+}
+
+/* Return a new chunk with the content of the next string. */
+struct chunk *stateGetChunk(struct stateReader *rd)
+{
+    size_t len;
+    const char *p = stateGetStr(rd, &len);
+    struct chunk *ch = chunkAllocSize(len);
+    memcpy(ch->data, p, len);
+    ch->u.used = len;
+    return ch;
+}
+
+void stateSaveRoom(uint64_t key, void *val, void *privdata)
+{
+    struct room *r = val;
+    struct logBuffer *b = privdata;
+    struct history *h = &r->history;
+    (void)key;
+    statePutStr(b, internStr(r->name), internLen(r->name));
+    statePutU64(b, r->seq);
+    statePutU64(b, h->count);
+    for (int j = 0; j < h->count; j++)
+    {
+        struct historyEntry *e = h->entries + (h->first + j) % HISTORY_MAX_MSGS;
+        statePutStr(b, internStr(e->sender), internLen(e->sender));
+        statePutU64(b, e->seq);
+        statePutStr(b, e->msg->data, e->msg->u.used);
+    }
+}
+
+/* Rooms are saved with their sequence number and history. Rooms without
+ * members are saved too, since they have history. */
+void stateSaveRooms(struct logBuffer *b)
+{
+    statePutU64(b, Chat->rooms.used);
+    dictForEach(&Chat->rooms, stateSaveRoom, b);
+}
+
+/* Load the rooms, replacing their history. After an upgrade what was
+ * loaded from the log is replaced, since the saved rooms are as recent as
+ * it gets. A snapshot is loaded before the log, that then brings the rooms
+ * up to date. */
+void stateLoadRooms(struct stateReader *rd)
+{
+    uint64_t count = stateGetU64(rd);
+    for (uint64_t j = 0; j < count && !rd->err; j++)
+    {
+        int name = stateGetIntern(rd);
+        struct room *r = roomGet(name);
+        internRelease(name);
+        historyClear(&r->history);
+        r->seq = stateGetU64(rd);
+        uint64_t entries = stateGetU64(rd);
+        for (uint64_t k = 0; k < entries && !rd->err; k++)
+        {
+            int sender = stateGetIntern(rd);
+            uint64_t seq = stateGetU64(rd);
+            struct chunk *msg = stateGetChunk(rd);
+            historyAppend(r, msg, sender, seq);
+            chunkRelease(msg);
+            internRelease(sender);
+        }
+    }
+}
+
+/* An ack window is saved as its next id followed by the unacknowledged
+ * DMs, or as a zero id if there is no window. */
+void stateSaveAcks(struct logBuffer *b, struct ackWindow *w)
+{
+    statePutU64(b, w ? w->nextid : 0);
+    if (w == NULL)
+        return;
+    statePutU64(b, w->sent);
+    statePutU64(b, w->count);
+    for (int j = 0; j < w->count; j++)
+    {
+        struct ackEntry *e = w->entries + (w->first + j) % ACK_WINDOW;
+        statePutU64(b, e->id);
+        statePutStr(b, e->msg->data, e->msg->u.used);
+    }
+}
+
+struct ackWindow *stateLoadAcks(struct stateReader *rd)
+{
+    uint64_t nextid = stateGetU64(rd);
+    if (nextid == 0)
+        return NULL;
+    struct ackWindow *w = ackWindowCreate();
+    w->nextid = nextid;
+    w->sent = stateGetU64(rd);
+    uint64_t count = stateGetU64(rd);
+    for (uint64_t j = 0; j < count && j < ACK_WINDOW && !rd->err; j++)
+    {
+        struct ackEntry *e = w->entries + w->count;
+        e->id = stateGetU64(rd);
+        e->msg = stateGetChunk(rd);
+        w->bytes += e->msg->u.used;
+        w->count++;
+    }
+    return w;
+}
+
+/* Return the interned id of the next string, or -1 if it is empty. Used
+ * for the current room, that also appears in the list of rooms: no
+ * reference is kept. */
+int stateGetRoomName(struct stateReader *rd)
+{
+    size_t len;
+    const char *p = stateGetStr(rd, &len);
+    if (len == 0)
+        return -1;
+    int id = internGet(p, len);
+    internRelease(id);
+    return id;
+}
+
+void statePutRoomName(struct logBuffer *b, int room)
+{
+    if (room == -1)
+        statePutStr(b, "", 0);
+    else
+        statePutStr(b, internStr(room), internLen(room));
+}
+
+/* Save a session with the state of a client that went away. */
+void stateSaveSession(struct logBuffer *b, const unsigned char *token,
+                      time_t detached, int nick, int room, int *rooms,
+                      uint64_t *seen, int numrooms, struct ackWindow *acks)
+{
+    statePutStr(b, (const char *)token, SESSION_TOKEN_LEN);
+    statePutU64(b, detached);
+    statePutStr(b, internStr(nick), internLen(nick));
+    statePutRoomName(b, room);
+    statePutU64(b, numrooms);
+    for (int j = 0; j < numrooms; j++)
+    {
+        statePutStr(b, internStr(rooms[j]), internLen(rooms[j]));
+        statePutU64(b, seen[j]);
+    }
+    stateSaveAcks(b, acks);
+}
+
+/* Save the detached sessions, oldest first, so that they keep expiring
+ * in order. If 'clients' is true the sessions of the connected clients
+ * follow, as if they just disconnected; otherwise they are expected to
+ * be saved with their clients. Clients that are not live have no session
+ * to save, see clientIsLive(). */
+void stateSaveSessions(struct logBuffer *b, int clients)
+{
+    uint64_t count = 0;
+    struct clientSet *active = &Chat->active;
+    for (int j = setNext(active, 0); clients && j != -1;
+         j = setNext(active, j + 1))
+        count += clientIsLive(Chat->clients[j]);
+    for (struct session *s = Sessions.head; s; s = s->next)
+        count++;
+    statePutU64(b, count);
+    for (struct session *s = Sessions.head; s; s = s->next)
+        stateSaveSession(b, s->token, s->detached, s->nick, s->room,
+                         s->rooms, s->seen, s->numrooms, s->acks);
+    if (!clients)
+        return;
+    for (int j = setNext(active, 0); j != -1; j = setNext(active, j + 1))
+    {
+        struct client *c = Chat->clients[j];
+        if (!clientIsLive(c))
+            continue;
+        stateSaveSession(b, c->session->token, Clock.unixtime, c->nick,
+                         c->room, c->rooms, c->seen, c->numrooms, c->acks);
+    }
+}
+
+/* Read a session token into 'token'. Return -1 on errors. */
+int stateGetToken(struct stateReader *rd, unsigned char *token)
+{
+    size_t len;
+    const char *p = stateGetStr(rd, &len);
+    if (len != SESSION_TOKEN_LEN)
+    {
+        rd->err = 1;
+        return -1;
+    }
+    memcpy(token, p, len);
+    return 0;
+}
+
+/* Load the sessions, moving their detach time 'shift' seconds forward. */
+void stateLoadSessions(struct stateReader *rd, time_t shift)
+{
+    uint64_t count = stateGetU64(rd);
+    for (uint64_t j = 0; j < count && !rd->err; j++)
+    {
+        unsigned char token[SESSION_TOKEN_LEN];
+        if (stateGetToken(rd, token) == -1)
+            break;
+        struct session *s = sessionCreate(NULL);
+        sessionSetToken(s, token);
+        time_t detached = stateGetU64(rd);
+        s->nick = stateGetIntern(rd);
+        int room = stateGetRoomName(rd);
+        uint64_t numrooms = stateGetU64(rd);
+        if (numrooms > rd->left / sizeof(uint64_t))
+            numrooms = 0; // Garbage: rd->err is set below anyway.
+        s->rooms = chatMalloc(sizeof(int) * numrooms);
+        s->seen = chatMalloc(sizeof(uint64_t) * numrooms);
+        for (s->numrooms = 0; s->numrooms < (int)numrooms; s->numrooms++)
+        {
+            s->rooms[s->numrooms] = stateGetIntern(rd);
+            s->seen[s->numrooms] = stateGetU64(rd);
+        }
+        s->room = room;
+        s->acks = stateLoadAcks(rd);
+        sessionLink(s, detached + shift);
+    }
+}
+
+void stateSaveOfflineQueue(uint64_t key, void *val, void *privdata)
+{
+    struct offlineQueue *q = val;
+    struct logBuffer *b = privdata;
+    statePutU64(b, key);
+    statePutU64(b, q->count);
+    for (struct offlineMsg *m = q->head; m; m = m->next)
+    {
+        statePutU64(b, m->ctime);
+        statePutU64(b, m->len);
+        statePutU64(b, m->msg == NULL);
+        if (m->msg)
+        {
+            statePutStr(b, m->msg->data, m->len);
+        }
+        else
+        {
+            statePutU64(b, Log.segments[m->segment]->firstid);
+            statePutU64(b, m->offset);
+        }
+    }
+}
+
+/* Offline DMs kept in memory are saved as they are. The ones in the log
+ * are saved as a reference to their segment, by id, since the index of
+ * the segment may not be the same for whoever loads them. */
+void stateSaveOffline(struct logBuffer *b)
+{
+    statePutU64(b, Offline.queues.used);
+    dictForEach(&Offline.queues, stateSaveOfflineQueue, b);
+}
+
+void stateLoadOffline(struct stateReader *rd)
+{
+    uint64_t count = stateGetU64(rd);
+    for (uint64_t j = 0; j < count && !rd->err; j++)
+    {
+        uint64_t nickhash = stateGetU64(rd);
+        uint64_t msgs = stateGetU64(rd);
+        for (uint64_t k = 0; k < msgs && !rd->err; k++)
+        {
+            time_t ctime = stateGetU64(rd);
+            size_t len = stateGetU64(rd);
+            int logged = stateGetU64(rd);
+            struct chunk *msg = NULL;
+            int segment = -1;
+            uint64_t offset = 0;
+            if (!logged)
+            {
+                msg = stateGetChunk(rd);
+            }
+            else
+            {
+                uint64_t firstid = stateGetU64(rd);
+                offset = stateGetU64(rd);
+                for (int s = 0; s < Log.numsegments; s++)
+                    if (Log.segments[s]->firstid == firstid)
+                        segment = s;
+                if (segment == -1)
+                    continue; // The log changed meanwhile: lost.
+            }
+            struct offlineMsg *m = offlineQueueLink(nickhash, len);
+            m->ctime = ctime;
+            m->msg = msg;
+            m->segment = segment;
+            m->offset = offset;
+            if (msg)
+                Offline.memory += len;
+            else
+                Offline.logged += len;
+        }
+    }
+}
+
+/* ================================= Snapshots ==================================
+ * With --snapshot <file> the state is saved every --snapshot-interval
+ * seconds (and on SIGUSR1) in a compact binary file: rooms with their
+ * sequence numbers and history, sessions (also the ones of the connected
+ * clients, as if they just went away) and offline DMs, followed by the
+ * CRC32 of everything. The id of the next message in the log is saved
+ * too, so that the log tells what happened after the snapshot.
+ *
+ * Like Redis BGSAVE, the snapshot is written by a fork()ed child: the
+ * kernel shares the memory between the two processes, so the child sees
+ * the state as it was at the fork, and the parent goes on serving. The
+ * only pause is the fork() itself, that copies the page tables. After
+ * that, every page the parent writes is copied for the child (copy on
+ * write): the child reports how much of its memory became private, so
+ * that we know what snapshots cost in memory.
+ *
+ * The child closes the sockets it inherited, otherwise the clients the
+ * parent disconnects meanwhile would not see the connection closed. The
+ * file is written with a temporary name and renamed, so there is always a
+ * complete snapshot on disk.
+ *
+ * At startup the snapshot is mmap()ed and loaded, and only the messages of
+ * the log after it are replayed, so restarting takes the same time however
+ * long the history is. The rooms are loaded before the log, that brings
+ * them up to date; the sessions and offline DMs after it, since DMs may
+ * reference log segments. Sessions get back the time the server was down,
+ * otherwise nobody could resume after a long restart.
+ * =========================================================================== */
+
+#define SNAPSHOT_MAGIC 0x31504e5354414843ULL // Version of the format.
+
+/* What the child tells the parent when done. */
+struct snapshotResult
+{
+    int ok;
+    int64_t bytes;    // Size of the snapshot.
+    int64_t cowbytes; // Memory copied on write during the save.
+    int64_t ms;       // Time to write it.
+};
+
+struct snapshotState
+{
+    volatile sig_atomic_t requested; // SIGUSR1 received.
+    pid_t pid;                       // Child writing the snapshot, or -1.
+    int pipefd;                      // Where the child sends the result.
+    time_t lastrun;                  // When the last snapshot started.
+    int64_t forkus;                  // Duration of the last fork().
+    struct snapshotResult last;      // Of the last successful snapshot.
+    uint64_t saved, failed;
+    char *map;                       // Snapshot being loaded at startup...
+    size_t maplen;
+    struct stateReader rd;           // ...and what is left to load.
+    time_t savetime;                 // When it was saved.
+};
+
+struct snapshotState Snapshot = {.pid = -1, .pipefd = -1};
+
+/* Serialize the state and write it to 'path'. Return the size of the
+ * snapshot, or -1 on errors. */
+int64_t snapshotWrite(const char *path)
+{
+    struct logBuffer b = {NULL, 0, 0};
+    statePutU64(&b, SNAPSHOT_MAGIC);
+    statePutU64(&b, Log.nextid);
+    statePutU64(&b, Clock.unixtime);
+    stateSaveRooms(&b);
+    stateSaveSessions(&b, 1);
+    stateSaveOffline(&b);
+    statePutU64(&b, crc32(0, b.p, b.len));
+
+    size_t tmplen = strlen(path) + 5;
+    char *tmp = chatMalloc(tmplen);
+    snprintf(tmp, tmplen, "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    size_t written = 0;
+    while (fd != -1 && written < b.len)
+    {
+        ssize_t nwritten = write(fd, b.p + written, b.len - written);
+        if (nwritten == -1 && errno != EINTR)
+            break;
+        if (nwritten > 0)
+            written += nwritten;
+    }
+    int64_t retval = -1;
+    if (fd != -1 && written == b.len && fsync(fd) == 0 && close(fd) == 0)
+    {
+        fd = -1;
+        if (rename(tmp, path) == 0)
+            retval = b.len;
+    }
+    if (fd != -1)
+        close(fd);
+    if (retval == -1)
+        unlink(tmp);
+    free(tmp);
+    free(b.p);
+    return retval;
+}
+
+/* Return the private dirty memory of this process: in the child, the
+ * pages that were copied because the parent (or the child itself) wrote
+ * them after the fork. */
+int64_t snapshotPrivateDirty(void)
+{
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp == NULL)
+        fp = fopen("/proc/self/smaps", "r"); // Older kernels: sum it up.
+    if (fp == NULL)
+        return 0;
+    char line[256];
+    int64_t total = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        long long kb;
+        if (sscanf(line, "Private_Dirty: %lld kB", &kb) == 1)
+            total += kb * 1024;
+    }
+    fclose(fp);
+    return total;
+}
+
+/* In the child: save the snapshot and send the result to the parent over
+ * 'fd'. The serialization buffer is released before measuring the
+ * memory, since it is not something the parent caused. */
+void snapshotChild(int fd)
+{
+    struct snapshotResult res;
+    int64_t start = ustime();
+    if (dup2(fd, 3) == -1)
+        _exit(1);
+    closeFrom(4);
+    res.bytes = snapshotWrite(Config.snapshot);
+    res.ok = res.bytes != -1;
+    res.cowbytes = snapshotPrivateDirty();
+    res.ms = (ustime() - start) / 1000;
+    if (write(3, &res, sizeof(res)) != sizeof(res))
+        _exit(1);
+    _exit(res.ok ? 0 : 1);
+}
+
+/* Start a snapshot in the background, if one is not already running. */
+void snapshotStart(void)
+{
+    Snapshot.requested = 0;
+    if (Snapshot.pid != -1)
+        return;
+    Snapshot.lastrun = Clock.unixtime;
+    int fds[2];
+    if (pipe(fds) == -1)
+    {
+        perror("Snapshot pipe");
+        Snapshot.failed++;
+        return;
+    }
+    fflush(stdout); // Or the child would inherit what is buffered.
+    int64_t start = ustime();
+    pid_t pid = fork();
+    if (pid == 0)
+        snapshotChild(fds[1]);
+    Snapshot.forkus = ustime() - start;
+    close(fds[1]);
+    if (pid == -1)
+    {
+        perror("Snapshot fork");
+        close(fds[0]);
+        Snapshot.failed++;
+        return;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    Snapshot.pid = pid;
+    Snapshot.pipefd = fds[0];
+}
+
+/* Collect the result of the child, if it exited. */
+void snapshotCheck(void)
+{
+    int status;
+    if (Snapshot.pid == -1)
+        return;
+    pid_t pid = waitpid(Snapshot.pid, &status, WNOHANG);
+    if (pid == 0)
+        return;
+
+    struct snapshotResult res;
+    if (pid == Snapshot.pid && WIFEXITED(status) &&
+        WEXITSTATUS(status) == 0 &&
+        read(Snapshot.pipefd, &res, sizeof(res)) == sizeof(res) && res.ok)
+    {
+        Snapshot.last = res;
+        Snapshot.saved++;
+        printf("Snapshot saved to %s: %lld bytes in %lld ms, "
+               "%lld KB copied on write, fork took %lld usec\n",
+               Config.snapshot, (long long)res.bytes, (long long)res.ms,
+               (long long)res.cowbytes / 1024, (long long)Snapshot.forkus);
+    }
+    else
+    {
+        Snapshot.failed++;
+        fprintf(stderr, "Snapshot to %s failed\n", Config.snapshot);
+    }
+    close(Snapshot.pipefd);
+    Snapshot.pipefd = -1;
+    Snapshot.pid = -1;
+}
+
+/* Called by serverCron(). */
+void snapshotCron(time_t now)
+{
+    if (Config.snapshot == NULL)
+        return;
+    snapshotCheck();
+    if (Config.snapshotinterval &&
+        now - Snapshot.lastrun >= Config.snapshotinterval)
+        snapshotStart();
+}
+
+/* Map the snapshot and load the rooms. Return the id of the first
+ * message of the log that is not in the snapshot, or 0 if there is no
+ * valid snapshot. Call snapshotLoadFinish() after loading the log. */
+uint64_t snapshotLoad(void)
+{
+    int64_t start = ustime();
+    int fd = open(Config.snapshot, O_RDONLY);
+    if (fd == -1)
+    {
+        if (errno != ENOENT)
+            perror("Opening the snapshot");
+        return 0;
+    }
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= 32)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Snapshot %s is not valid, ignoring it\n",
+                Config.snapshot);
+        return 0;
+    }
+
+    size_t len = st.st_size - sizeof(uint64_t);
+    uint64_t crc, magic;
+    memcpy(&crc, map + len, sizeof(crc));
+    memcpy(&magic, map, sizeof(magic));
+    if (magic != SNAPSHOT_MAGIC || crc != crc32(0, map, len))
+    {
+        fprintf(stderr, "Snapshot %s is corrupted, ignoring it\n",
+                Config.snapshot);
+        munmap(map, st.st_size);
+        return 0;
+    }
+    Snapshot.map = map;
+    Snapshot.maplen = st.st_size;
+    Snapshot.rd = (struct stateReader){map + sizeof(magic),
+                                       len - sizeof(magic), 0};
+    uint64_t nextid = stateGetU64(&Snapshot.rd);
+    Snapshot.savetime = stateGetU64(&Snapshot.rd);
+    stateLoadRooms(&Snapshot.rd);
+    if (nextid > Log.nextid)
+        Log.nextid = nextid;
+    printf("Snapshot %s: %zu rooms, saved %lld seconds ago, loaded in "
+           "%lld ms\n", Config.snapshot, Chat->rooms.used,
+           (long long)(Clock.unixtime - Snapshot.savetime),
+           (long long)(ustime() - start) / 1000);
+    return nextid;
+}
+
+/* Load the rest of the snapshot, and release it. */
+void snapshotLoadFinish(void)
+{
+    if (Snapshot.map == NULL)
+        return;
+    int64_t start = ustime();
+    time_t downtime = Clock.unixtime - Snapshot.savetime;
+    stateLoadSessions(&Snapshot.rd, downtime > 0 ? downtime : 0);
+    stateLoadOffline(&Snapshot.rd);
+    if (Snapshot.rd.err)
+        fprintf(stderr, "Snapshot %s: truncated state\n", Config.snapshot);
+    munmap(Snapshot.map, Snapshot.maplen);
+    Snapshot.map = NULL;
+    printf("Snapshot %s: %zu sessions, %zu offline queues, loaded in "
+           "%lld ms\n", Config.snapshot, Sessions.table.used,
+           Offline.queues.used, (long long)(ustime() - start) / 1000);
+}
+
+void snapshotSignalHandler(int sig)
+{
+    (void)sig;
+    Snapshot.requested = 1;
+}
+
+void snapshotInit(void)
+{
+    if (Config.snapshot == NULL)
+        return;
+    Snapshot.lastrun = Clock.unixtime;
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = snapshotSignalHandler;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGUSR1, &act, NULL);
+}
+
+/* ====================== Small chat core implementation ========================
+ * Here the idea is very simple: we accept new connections, read what clients
+ * write us and fan-out (that is, send-to-all) the message to everybody
+ * with the exception of the sender. And that is, of course, the most
+ * simple chat system ever possible.
+ * =========================================================================== */
+
+/* Timer callbacks, defined later, but set up when clients are created. */
+void clientIdleTimer(struct timer *t);
+void clientAckTimer(struct timer *t);
+void clientOutputTimer(struct timer *t);
+void clientRateTimer(struct timer *t);
+void cronTimer(struct timer *t);
+
+/* Make sure the 'clients' table has a slot for the descriptor 'fd'. The
+ * table grows with the highest descriptor ever used, so the number of
+ * clients is only limited by --max-clients and the open files limit. */
+void clientTableReserve(int fd)
+{
+    if (fd < Chat->clientscap)
+        return;
+    int newcap = Chat->clientscap ? Chat->clientscap : 64;
+    while (newcap <= fd)
+        newcap *= 2;
+    Chat->clients = chatRealloc(Chat->clients,
+                                sizeof(*Chat->clients) * newcap);
+    memset(Chat->clients + Chat->clientscap, 0,
+           sizeof(*Chat->clients) * (newcap - Chat->clientscap));
+    Chat->clientscap = newcap;
+}
+
+/* Create a new client bound to 'fd', connected from the IPv4 address
+ * 'addr'. This is called when a new client connects. As a side effect
+ * updates the global Chat state. */
+struct client *createClient(int fd, uint32_t addr) {
+    char nick[32]; // Used to create an initial nick for the user.
+    int nicklen = snprintf(nick, sizeof(nick), "user:%d", fd);
+    struct client *c = chatMalloc(sizeof(*c));
+    memset(c, 0, sizeof(*c)); // Empty buffers, no flags.
+    socketSetNonBlockNoDelay(fd); // Pretend this will not fail.
+    c->fd = fd;
+    c->nick = internGet(nick, nicklen);
+    c->readlen = READ_LEN_MIN;
+    c->lastinput = Clock.unixtime;
+    timerSetup(&c->idletimer, clientIdleTimer, c);
+    timerSetup(&c->acktimer, clientAckTimer, c);
+    timerSetup(&c->outputtimer, clientOutputTimer, c);
+    timerSetup(&c->ratetimer, clientRateTimer, c);
+    c->ip = ipAttach(addr);
+    if (Config.timeout)
+        timerSet(&c->idletimer, Config.timeout * 1000);
+    clientTableReserve(c->fd);
+    assert(Chat->clients[c->fd] == NULL);
+    Chat->clients[c->fd] = c;
+    setAdd(&Chat->active, c->fd);
+    c->session = sessionCreate(c);
+    Chat->numclients++;
+    return c;
+}
+
+/* Admission control. A new connection is refused if the server already
+ * has as many clients as --max-clients allows, or if its address has as
+ * many as --max-clients-per-ip allows. Return 1 if the client can be
+ * created. */
+int admitClient(uint32_t addr)
+{
+    if (Chat->numclients >= Config.maxclients)
+        return 0;
+    struct ipState *ip = dictFind(&Chat->ips, addr);
+    return !Config.maxperip || !ip || ip->clients < Config.maxperip;
+}
+
+/* Tell a connection we don't admit that the server is full, and close it.
+ * The reply fits any socket buffer, and we don't wait if it doesn't: a
+ * server under load must shed connections as cheaply as possible. */
+void refuseClient(int fd)
+{
+    static const char *full = "Server is full, try again later\n";
+    if (send(fd, full, strlen(full), MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+    {
+        /* Nothing to do, we close it anyway. */
+    }
+    close(fd);
+    Chat->stat_rejected++;
+}
+
+/* accept() failed since we ran out of descriptors. The connection stays
+ * pending, so the listening socket would be reported as readable again
+ * and again, spinning the event loop. Use the spare descriptor to accept
+ * the connection and refuse it, then reserve it again. */
+void shedConnection(void)
+{
+    uint32_t addr;
+    if (Chat->sparefd == -1)
+        return;
+    close(Chat->sparefd);
+    int fd = acceptClient(Chat->serversock, &addr);
+    if (fd != -1)
+        refuseClient(fd);
+    Chat->sparefd = open("/dev/null", O_RDONLY);
+}
+
+/* Free a client, associated resources, and unbind it from the global
+ * state in Chat. */
+void freeClient(struct client *c)
+{
+    sessionDetach(c); // Before leaving the rooms: it saves them.
+    roomPartAll(c);
+    Chat->backlog -= c->queued;
+    if (c->acks)
+        ackWindowFree(c->acks, internHash(c->nick));
+    internRelease(c->nick);
+    cbufClear(&c->inbuf);
+    cbufClear(&c->outq);
+    cbufClear(&c->held);
+    free(c->query);
+    if (c->search)
+        c->search->c = NULL; // The job completes without us.
+    timerCancel(&c->idletimer);
+    timerCancel(&c->acktimer);
+    timerCancel(&c->outputtimer);
+    timerCancel(&c->ratetimer);
+    ipDetach(c->ip);
+    close(c->fd);
+    Chat->clients[c->fd] = NULL;
+    setDel(&Chat->active, c->fd);
+    setDel(&Chat->pendingwrite, c->fd);
+    setDel(&Chat->querying, c->fd);
+    setDel(&Chat->flowpaused, c->fd);
+    setDel(&Chat->pendingread, c->fd);
+    Chat->numclients--;
+    free(c);
+}
+
+/* Allocate and init the global stuff. */
+void initChat(void)
+{
+    int64_t start = ustime();
+    Chat = chatMalloc(sizeof(*Chat));
+    memset(Chat, 0, sizeof(*Chat));
+    /* No clients at startup, of course. */
+    Chat->numclients = 0;
+    tzset(); // Once for all, clockTimestamp() uses localtime_r().
+    clockUpdate();
+
+    /* Create our listening socket, bound to the given port. This
+     * is where our clients will connect. After an upgrade, we get the
+     * one of the old process instead, see upgradeLoad(). */
+    Chat->serversock = -1;
+    if (Config.upgradefd == -1)
+        Chat->serversock = createTCPServer(Config.port);
+    if (Config.upgradefd == -1 && Chat->serversock == -1)
+    {
+        perror("Creating listening socket");
+        exit(1);
+    }
+
+    /* Keep a descriptor aside, to be able to accept and close connections
+     * when we run out of them. */
+    Chat->sparefd = open("/dev/null", O_RDONLY);
+
+    bioInit();
+    uint64_t replayid = 0;
+    if (Config.snapshot && Config.upgradefd == -1)
+        replayid = snapshotLoad();
+    if (Config.logdir)
+        logInit(Config.logdir, replayid);
+    snapshotLoadFinish();
+
+    timerInit();
+    timerSetup(&Chat->crontimer, cronTimer, NULL);
+    timerSet(&Chat->crontimer, 1000);
+    printf("Ready to accept connections, started in %lld ms\n",
+           (long long)(ustime() - start) / 1000);
+}
+
+/* Update the global backlog, and the backlog of the rooms of the client,
+ * after its output queue changed. See flowControl(). */
+void clientBacklogUpdate(struct client *c)
+{
+    size_t queued = c->outq.len - c->outq.filelen + c->held.len;
+    if (queued == c->queued)
+        return;
+    Chat->backlog += queued - c->queued;
+    for (int j = 0; j < c->numrooms; j++)
+        roomLookup(c->rooms[j])->backlog += queued - c->queued;
+    c->queued = queued;
+}
+
+/* Called after something was added to the client output queue. We don't
+ * write immediately: the client is flagged as having pending output, and
+ * handleClientsWithPendingWrites() will write everything we queued for it
+ * in a single writev() before the event loop goes back to poll(). */
+void clientQueued(struct client *c)
+{
+    setAdd(&Chat->pendingwrite, c->fd);
+    clientBacklogUpdate(c);
+    /* Only memory counts: ranges of files waiting to be sent cost us
+     * nothing but a node. */
+    size_t queued = c->outq.len - c->outq.filelen + c->held.len;
+    if (queued > CLIENT_OUTPUT_LIMIT && !(c->flags & CLIENT_CLOSE_ASAP))
+    {
+        /* The client is not reading what we send: we can't buffer
+         * forever, so it is disconnected as soon as possible. */
+        printf("Client fd=%d, nick=%s reached the output limit\n",
+               c->fd, internStr(c->nick));
+        c->flags |= CLIENT_CLOSE_ASAP;
+    }
+    else if (queued > CLIENT_OUTPUT_SOFT_LIMIT &&
+             !timerIsArmed(&c->outputtimer))
+    {
+        /* Maybe just a burst: give the client some time to catch up. */
+        timerSet(&c->outputtimer, CLIENT_OUTPUT_GRACE * 1000);
+    }
+}
+
+/* Fires CLIENT_OUTPUT_GRACE seconds after the client went over the soft
+ * output limit: if it is still over it, it is not going to catch up. */
+void clientOutputTimer(struct timer *t)
+{
+    struct client *c = t->privdata;
+    if (c->outq.len - c->outq.filelen + c->held.len > CLIENT_OUTPUT_SOFT_LIMIT)
+    {
+        printf("Client fd=%d, nick=%s stayed over the soft output limit\n",
+               c->fd, internStr(c->nick));
+        c->flags |= CLIENT_CLOSE_ASAP;
+        setAdd(&Chat->pendingwrite, c->fd); // Freed before sleeping.
+    }
+}
+
+/* Return the buffer where output for the client should be queued. While
+ * a /history query is streamed, everything else is held back and sent
+ * after it, so that the client sees the history before what happened
+ * meanwhile. */
+struct chunkBuf *clientOutput(struct client *c)
+{
+    return c->query ? &c->held : &c->outq;
+}
+
+/* Queue a copy of 'len' bytes at 'p' for the client. */
+void clientWrite(struct client *c, const char *p, size_t len)
+{
+    if (c->flags & CLIENT_CLOSE_ASAP)
+        return;
+    cbufAppend(clientOutput(c), p, len);
+    clientQueued(c);
+}
+
+/* Queue a null terminated string for the client. */
+void clientWriteString(struct client *c, const char *s)
+{
+    clientWrite(c, s, strlen(s));
+}
+
+/* Queue a reference to a shared chunk for the client, no copy is made. */
+void clientWriteChunk(struct client *c, struct chunk *ch)
+{
+    if (c->flags & CLIENT_CLOSE_ASAP)
+        return;
+    cbufAppendChunk(clientOutput(c), ch, 0, ch->u.used);
+    clientQueued(c);
+}
+
+/* Queue 'len' bytes of the file chunk 'ch' starting at 'offset'. They are
+ * read from the file only when the socket can take them. Unlike the other
+ * clientWrite*() functions this always writes to the output queue: it is
+ * used to stream the /history query itself. */
+void clientWriteFile(struct client *c, struct chunk *ch, uint64_t offset,
+                     size_t len)
+{
+    if (c->flags & CLIENT_CLOSE_ASAP)
+        return;
+    cbufAppendChunk(&c->outq, ch, offset, len);
+    clientQueued(c);
+}
+
+/* Remember, for every room of the client, the sequence number of the last
+ * message it received. Only done when nothing is pending for the client:
+ * then it received everything sent to its rooms so far. */
+void clientUpdateSeen(struct client *c)
+{
+    if (c->outq.len || c->query)
+        return;
+    for (int j = 0; j < c->numrooms; j++)
+        c->seen[j] = roomLookup(c->rooms[j])->seq;
+}
+
+/* Write as much as possible of the client output queue to its socket.
+ * Return 0 on success (even if the socket could not take everything),
+ * -1 if the connection should be dropped.
+ *
+ * Memory nodes are written with writev(), file nodes with sendfile(), so
+ * the kernel copies them from the page cache to the socket directly. The
+ * queue is written strictly in order, so what was queued after a file
+ * range is sent after it. */
+int clientFlush(struct client *c)
+{
+    struct iovec iov[CHUNKBUF_MAX_IOV];
+    while (c->outq.len)
+    {
+        struct bufNode *n = c->outq.head;
+        ssize_t nwritten;
+        if (n->chunk->class == CHUNK_FILE)
+        {
+            off_t offset = n->start;
+            nwritten = sendfile(c->fd, n->chunk->u.fd, &offset,
+                                n->end - n->start);
+            if (nwritten == 0)
+                return -1; // The file is shorter than the range.
+            if (nwritten > 0)
+                Chat->stat_sendfile_bytes += nwritten;
+        }
+        else
+        {
+            int iovcnt = cbufIov(&c->outq, iov, CHUNKBUF_MAX_IOV);
+            nwritten = writev(c->fd, iov, iovcnt);
+        }
+        if (nwritten == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break; // Kernel buffer full, poll() will tell us when.
+            return -1;
+        }
+        cbufConsume(&c->outq, nwritten);
+    }
+    clientBacklogUpdate(c);
+    if (c->outq.len == 0)
+    {
+        setDel(&Chat->pendingwrite, c->fd);
+        clientUpdateSeen(c);
+    }
+    return 0;
+}
+
+/* Try to write the pending output of all the clients we queued data for,
+ * and release the clients we want to disconnect. */
+void handleClientsWithPendingWrites(void)
+{
+    struct clientSet *pending = &Chat->pendingwrite;
+    for (int j = setNext(pending, 0); j != -1; j = setNext(pending, j + 1))
+    {
+        struct client *c = Chat->clients[j];
+        if (c->flags & CLIENT_CLOSE_ASAP || clientFlush(c) == -1)
+        {
+            printf("Disconnected client fd=%d, nick=%s\n",
+                   j, internStr(c->nick));
+            freeClient(c);
+        }
+    }
+}
+
+/* Graceful shutdown. On SIGTERM or SIGINT we stop accepting connections
+ * and reading from clients, tell everybody, and keep running the event
+ * loop only to send the output still queued, for up to --shutdown-timeout
+ * seconds. Then the log is synced to disk and we exit. A second signal
+ * makes us stop waiting for slow clients. */
+struct shutdownState
+{
+    volatile sig_atomic_t signals; // SIGTERM/SIGINT received.
+    int active;                    // Shutting down.
+    int64_t start, deadline;       // In milliseconds.
+};
+
+struct shutdownState Shutdown;
+
+void shutdownSignalHandler(int sig)
+{
+    (void)sig;
+    Shutdown.signals++;
+}
+
+void shutdownInit(void)
+{
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = shutdownSignalHandler;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+}
+
+void shutdownStart(void)
+{
+    Shutdown.active = 1;
+    Shutdown.start = Clock.mstime;
+    Shutdown.deadline = Clock.mstime + Config.shutdowntimeout * 1000LL;
+    printf("Shutting down, sending the queued output to %d clients\n",
+           Chat->numclients);
+    close(Chat->serversock);
+    Chat->serversock = -1;
+    struct clientSet *pending = &Chat->pendingread;
+    for (int j = setNext(pending, 0); j != -1; j = setNext(pending, j + 1))
+        setDel(pending, j); // Left unprocessed.
+    struct clientSet *active = &Chat->active;
+    for (int j = setNext(active, 0); j != -1; j = setNext(active, j + 1))
+        clientWriteString(Chat->clients[j], "Server shutting down\n");
+}
+
+/* Called before sleeping while shutting down: exit once every client got
+ * its output, or at the deadline, reporting how it went. */
+void shutdownCheck(void)
+{
+    int drained = setNext(&Chat->pendingwrite, 0) == -1 &&
+                  setNext(&Chat->querying, 0) == -1;
+    if (!drained && Clock.mstime < Shutdown.deadline && Shutdown.signals < 2)
+        return;
+
+    size_t undelivered = 0;
+    int slow = 0;
+    struct clientSet *active = &Chat->active;
+    for (int j = setNext(active, 0); j != -1; j = setNext(active, j + 1))
+    {
+        struct client *c = Chat->clients[j];
+        size_t left = c->outq.len + c->held.len;
+        if (left || c->query)
+            slow++;
+        undelivered += left;
+    }
+    logSync();
+    printf("Shutdown %s in %lld ms: %d clients, %d not fully served, "
+           "%zu bytes not delivered\n",
+           drained ? "completed" : "timed out",
+           (long long)(Clock.mstime - Shutdown.start), Chat->numclients,
+           slow, undelivered);
+    exit(0);
+}
+
+/* Send the specified string to all the members of the room but the one
+ * having as socket descriptor 'excluded'. If you want to send something
+ * to every member just set excluded to an impossible socket: -1. The
+ * message, sent by the nick 'sender' with the room sequence number 'seq',
+ * is also added to the room history. */
+void sendMsgToRoomBut(struct room *r, int excluded, int sender, uint64_t seq,
+                      char *s, size_t len)
+{
+    size_t timelen;
+    const char *time_buffer = clockTimestamp(&timelen);
+
+    /* Construct the new message with the timestamp. It is formatted just
+     * once in its own chunk, and every recipient output queue references
+     * the same chunk. */
+    struct chunk *msg = chunkAllocSize(timelen + 1 + len);
+    memcpy(msg->data, time_buffer, timelen);
+    msg->data[timelen] = ' ';
+    memcpy(msg->data + timelen + 1, s, len);
+    msg->u.used = msg->size;
+
+    /* Only the room members are visited, not every connected client. */
+    struct clientSet *members = &r->members;
+    for (int j = setNext(members, 0); j != -1; j = setNext(members, j + 1))
+    {
+        if (j == excluded)
+            continue;
+        clientWriteChunk(Chat->clients[j], msg); // send the message to the client
+    }
+    logAppend(LOG_ROOM_MSG, r->name, sender, -1, seq, msg->data, msg->size);
+    historyAppend(r, msg, sender, seq);
+    chunkRelease(msg); // Now only the output queues and history reference it.
+}
+
+/* Send to a client that just joined the room the messages in the room
+ * history. The messages are queued as they are, no formatting needed. */
+void historyReplay(struct client *c, struct room *r)
+{
+    struct history *h = &r->history;
+    for (int j = 0; j < h->count; j++)
+        clientWriteChunk(c, h->entries[(h->first + j) % HISTORY_MAX_MSGS].msg);
+}
+
+/* A /history query being streamed to a client. The messages are sent a
+ * page per event loop iteration, and the next page is only produced once
+ * the client received the previous one: a large query neither blocks the
+ * loop nor fills our memory. */
+struct historyQuery
+{
+    struct logScan scan;
+    int remaining;          // Messages still to send.
+    int sent;               // Messages sent so far.
+};
+
+/* Terminate the query of the client, releasing the output held back
+ * meanwhile. */
+void historyQueryEnd(struct client *c)
+{
+    struct historyQuery *q = c->query;
+    char reply[128];
+    int replylen;
+    if (q->sent)
+        replylen = snprintf(reply, sizeof(reply),
+                            "End of history: %d messages, ids %llu-%llu\n",
+                            q->sent, (unsigned long long)q->scan.firstid,
+                            (unsigned long long)q->scan.lastid);
+    else
+        replylen = snprintf(reply, sizeof(reply),
+                            "End of history: no messages\n");
+    c->query = NULL;
+    free(q);
+    setDel(&Chat->querying, c->fd);
+    clientWrite(c, reply, replylen);
+    cbufJoin(&c->outq, &c->held);
+    clientQueued(c);
+}
+
+/* Send the next page of the client query. Nothing is read or copied
+ * here: the output queue just references the ranges of the log files
+ * holding the messages, that are sent with sendfile() when the socket is
+ * ready. */
+void historyQueryStep(struct client *c)
+{
+    struct historyQuery *q = c->query;
+    struct logRange ranges[LOG_HISTORY_PAGE];
+    int numranges;
+    int max = q->remaining < LOG_HISTORY_PAGE ? q->remaining
+                                              : LOG_HISTORY_PAGE;
+    int found = logScanRoom(&q->scan, max, ranges, &numranges);
+    struct chunk *file = NULL;
+    int filesegment = -1;
+    for (int j = 0; j < numranges; j++)
+    {
+        if (ranges[j].segment != filesegment)
+        {
+            if (file)
+                chunkRelease(file);
+            filesegment = ranges[j].segment;
+            file = chunkAllocFile(Log.segments[filesegment]->datafd);
+            if (file == NULL)
+                break;
+        }
+        clientWriteFile(c, file, ranges[j].offset, ranges[j].len);
+    }
+    if (file)
+        chunkRelease(file);
+    q->remaining -= found;
+    q->sent += found;
+    if (q->remaining == 0 || q->scan.done)
+        historyQueryEnd(c);
+}
+
+/* Called before writing to the clients: advance the /history queries of
+ * the clients that received the previous page. */
+void handleHistoryQueries(void)
+{
+    struct clientSet *querying = &Chat->querying;
+    for (int j = setNext(querying, 0); j != -1; j = setNext(querying, j + 1))
+    {
+        struct client *c = Chat->clients[j];
+        if (c->outq.filelen == 0 && !(c->flags & CLIENT_CLOSE_ASAP))
+            historyQueryStep(c);
+    }
+}
+
+/* Start streaming to the client up to 'count' messages of the room 'r'
+ * from the log, scanning from 'cur' and stopping before the message
+ * 'endid'. Messages older than 'since' (Unix time in milliseconds) are
+ * skipped. */
+void historyQueryStart(struct client *c, struct room *r,
+                       struct logCursor *cur, uint64_t endid, int64_t since,
+                       int count)
+{
+    struct historyQuery *q = chatMalloc(sizeof(*q));
+    memset(q, 0, sizeof(*q));
+    q->scan.cur = *cur;
+    q->scan.roomhash = internHash(r->name);
+    q->scan.endid = endid;
+    q->scan.since = since;
+    q->remaining = count;
+    c->query = q;
+    setAdd(&Chat->querying, c->fd);
+    historyQueryStep(c);
+}
+
+/* Implements the /history command:
+ *
+ *   /history [count]                      The last messages of the room.
+ *   /history before <msgid> [count]       The messages before 'msgid'.
+ *   /history since <unixtime> [count]     The messages since that time.
+ *
+ * Messages are found via the sparse index of the log, so the cost does
+ * not depend on how far back in the history they are. The reply ends
+ * with the ids of the first and last message, so that a client can page
+ * back with "before". */
+void historyCommand(struct client *c, char *arg)
+{
+    char *argv[3];
+    int argc = 0;
+    for (char *tok = arg ? strtok(arg, " ") : NULL; tok && argc < 3;
+         tok = strtok(NULL, " "))
+        argv[argc++] = tok;
+
+    uint64_t before = Log.nextid;
+    int64_t since = -1;
+    int count = HISTORY_MAX_MSGS;
+    if (argc == 1)
+    {
+        count = atoi(argv[0]);
+    }
+    else if (argc >= 2 && !strcmp(argv[0], "before"))
+    {
+        before = strtoull(argv[1], NULL, 10);
+        if (argc == 3)
+            count = atoi(argv[2]);
+    }
+    else if (argc >= 2 && !strcmp(argv[0], "since"))
+    {
+        since = strtoll(argv[1], NULL, 10) * 1000;
+        count = argc == 3 ? atoi(argv[2]) : LOG_HISTORY_MAX;
+    }
+    else if (argc != 0)
+    {
+        count = 0;
+    }
+    if (count <= 0)
+    {
+        clientWriteString(c, "Usage: /history [before <msgid>|since "
+                             "<unixtime>] [count]\n");
+        return;
+    }
+    if (count > LOG_HISTORY_MAX)
+        count = LOG_HISTORY_MAX;
+    if (c->room == -1)
+    {
+        clientWriteString(c, "You are not in any room\n");
+        return;
+    }
+    struct room *r = roomLookup(c->room);
+    if (Log.dir == NULL)
+    {
+        /* Without the log only the history in memory is available. */
+        if (argc > 1)
+            clientWriteString(c, "History queries need the message log\n");
+        else
+            historyReplay(c, r);
+        return;
+    }
+    if (c->query)
+    {
+        clientWriteString(c, "A history query is already in progress\n");
+        return;
+    }
+
+    logFlush(); // The scan reads the log files.
+    struct logCursor cur;
+    if (before > Log.nextid)
+        before = Log.nextid;
+    if (since != -1)
+        logSeekTime(&cur, since);
+    else
+        count = logSeekBackRoom(&cur, internHash(r->name), before, count);
+    historyQueryStart(c, r, &cur, before, since, count);
+}
+
+/* Send the client the messages of the room 'r' after 'seq', preceded by
+ * a line telling how many they are. The messages come from the history in
+ * memory when it goes back enough, otherwise from the log. */
+void roomResume(struct client *c, struct room *r, uint64_t seq)
+{
+    uint64_t missed = r->seq > seq ? r->seq - seq : 0;
+
+    char reply[128];
+    int replylen = snprintf(reply, sizeof(reply),
+                            "Resumed #%s at seq %llu, %llu new messages\n",
+                            internStr(r->name), (unsigned long long)seq,
+                            (unsigned long long)missed);
+    clientWrite(c, reply, replylen);
+    if (missed == 0)
+        return;
+
+    struct history *h = &r->history;
+    struct historyEntry *oldest = h->entries + h->first;
+    if ((h->count && oldest->seq <= seq + 1) || Log.dir == NULL || c->query)
+    {
+        for (int j = 0; j < h->count; j++)
+        {
+            struct historyEntry *e =
+                h->entries + (h->first + j) % HISTORY_MAX_MSGS;
+            if (e->seq > seq)
+                clientWriteChunk(c, e->msg);
+        }
+        if (h->count == 0 || oldest->seq > seq + 1)
+            clientWriteString(c, "Older messages are not available\n");
+        return;
+    }
+
+    /* Every message of the room is in the log with consecutive sequence
+     * numbers, so the missed messages are just the last 'missed' ones. */
+    int count = missed > LOG_HISTORY_MAX ? LOG_HISTORY_MAX : missed;
+    struct logCursor cur;
+    logFlush();
+    count = logSeekBackRoom(&cur, internHash(r->name), Log.nextid, count);
+    historyQueryStart(c, r, &cur, Log.nextid, -1, count);
+}
+
+/* Implements /resume <room> <seq>: join the room, if needed, and send
+ * only the messages after 'seq', the last sequence number the client saw.
+ * This is what a client reconnecting, or noticing a gap in the sequence
+ * numbers, should use instead of a full history replay. */
+void resumeCommand(struct client *c, char *arg)
+{
+    char *name = arg ? strtok(arg, " ") : NULL;
+    char *seqarg = name ? strtok(NULL, " ") : NULL;
+    if (seqarg == NULL)
+    {
+        clientWriteString(c, "Usage: /resume <room> <seq>\n");
+        return;
+    }
+    if (name[0] == '#')
+        name++;
+    size_t namelen = strlen(name);
+    if (namelen == 0 || namelen > MAX_ROOM_LEN)
+    {
+        clientWriteString(c, "Invalid room name\n");
+        return;
+    }
+    uint64_t seq = strtoull(seqarg, NULL, 10);
+    roomResume(c, roomJoin(c, name, namelen, NULL), seq);
+}
+
+/* Runs in the event loop thread: send the results to the client. */
+void searchDone(void *arg)
+{
+    struct searchJob *job = arg;
+    if (job->c)
+    {
+        int results = 0;
+        for (size_t j = 0; j < job->replylen; j++)
+            results += job->reply[j] == '\n';
+        job->replylen += snprintf(job->reply + job->replylen, 128,
+            "Search: %d results in %lld us (%lld us evaluating)\n",
+            results, (long long)(ustime() - job->start),
+            (long long)job->evaltime);
+        job->c->search = NULL;
+        clientWrite(job->c, job->reply, job->replylen);
+    }
+    for (int j = 0; j < job->numsegments; j++)
+        for (int t = 0; t < job->numterms; t++)
+            free(job->segments[j].postings[t]);
+    free(job->segments);
+    free(job->reply);
+    free(job);
+}
+
+/* Implements /search <words> [#room]: parse the query, collect what the
+ * background thread needs and submit the job. */
+void searchCommand(struct client *c, char *arg)
+{
+    if (Log.dir == NULL)
+    {
+        clientWriteString(c, "Search needs the message log\n");
+        return;
+    }
+    if (c->search)
+    {
+        clientWriteString(c, "A search is already in progress\n");
+        return;
+    }
+
+    struct searchJob *job = chatMalloc(sizeof(*job));
+    memset(job, 0, sizeof(*job));
+    char tok[SEARCH_MAX_TOKEN];
+    for (char *word = arg ? strtok(arg, " ") : NULL; word;
+         word = strtok(NULL, " "))
+    {
+        if (word[0] == '#')
+        {
+            job->roomhash = internHashString(word + 1, strlen(word + 1));
+            continue;
+        }
+        size_t toklen, pos = 0, len = strlen(word);
+        while ((toklen = searchNextToken(word, len, &pos, tok)) != 0 &&
+               job->numterms < SEARCH_MAX_TERMS)
+            job->terms[job->numterms++] = internHashString(tok, toklen);
+    }
+    if (job->numterms == 0)
+    {
+        free(job);
+        clientWriteString(c, "Usage: /search <words> [#room]\n");
+        return;
+    }
+
+    logFlush(); // The thread reads the files.
+    job->c = c;
+    job->start = ustime();
+    job->numsegments = Log.numsegments;
+    job->segments = chatMalloc(sizeof(*job->segments) * job->numsegments);
+    memset(job->segments, 0, sizeof(*job->segments) * job->numsegments);
+    for (int j = 0; j < job->numsegments; j++)
+    {
+        struct logSegment *seg = Log.segments[job->numsegments - 1 - j];
+        struct searchSegment *s = &job->segments[j];
+        s->fd = seg->fd;
+        s->datafd = seg->datafd;
+        s->size = logSegmentFileSize(seg);
+        s->sdx = seg->sdx;
+        for (int t = 0; s->sdx == NULL && t < job->numterms; t++)
+        {
+            struct searchPosting *p = dictFind(&seg->terms, job->terms[t]);
+            if (p == NULL)
+                continue;
+            s->postings[t] = chatMalloc(p->len + 1);
+            memcpy(s->postings[t], p->buf, p->len);
+            s->postinglen[t] = p->len;
+        }
+    }
+    c->search = job;
+    bioSubmit(searchWork, searchDone, job);
+}
+
+/* Make the client join the room, showing it the room history if it was
+ * not already a member. */
+struct room *clientJoinRoom(struct client *c, const char *name, size_t len)
+{
+    int joined;
+    struct room *r = roomJoin(c, name, len, &joined);
+    if (joined)
+        historyReplay(c, r);
+    return r;
+}
+
+/* desc : handle direct message
+sender -- the client who sent the DM
+target_nick -- the target client's name
+message -- the message to be sent*/
+void handleDirectMessage(struct client *sender, char *target_nick, char *message) {
+    /* If the nick is not interned, nobody is using it. Otherwise matching
+     * a client is just an integer compare. */
+    struct client *target = NULL;
+    int target_id = internLookup(target_nick, strlen(target_nick));
+    for (int j = setNext(&Chat->active, 0); target_id != -1 && j != -1;
+         j = setNext(&Chat->active, j + 1)) {
+        if (Chat->clients[j]->nick == target_id) { // Check if the client is found and the nick matches
+            target = Chat->clients[j];
+            break;
+        }
+    }
+
+    // Construct the direct message
+    size_t nicklen = internLen(sender->nick);
+    size_t msglen = strlen(message);
+    size_t dmlen = 8 + nicklen + 2 + msglen + 1;
+
+    /* Nobody has the nick right now: the DM waits for them, if there is
+     * room in their queue. */
+    uint64_t target_hash = internHashString(target_nick, strlen(target_nick));
+    if (target == NULL && !offlineCanQueue(target_hash, dmlen, 1)) {
+        clientWriteString(sender, "User not found, and their offline "
+                                  "queue is full\n");
+        Offline.refused++;
+        return;
+    }
+    /* The target acknowledges its DMs, and did not ack too many of them:
+     * refuse the DM, delivery could not be guaranteed. */
+    if (target && target->acks && !ackWindowHasRoom(target->acks, dmlen)) {
+        clientWriteString(sender, "The user has too many unacknowledged "
+                                  "messages, retry later\n");
+        Acks.refused++;
+        return;
+    }
+
+    struct chunk *dm = chunkAllocSize(dmlen);
+    char *p = dm->data;
+    memcpy(p, "DM from ", 8);
+    memcpy(p + 8, internStr(sender->nick), nicklen);
+    memcpy(p + 8 + nicklen, ": ", 2);
+    memcpy(p + 8 + nicklen + 2, message, msglen);
+    p[dm->size - 1] = '\n';
+    dm->u.used = dm->size;
+    int to = internGet(target_nick, strlen(target_nick)); // For the log.
+    logAppend(LOG_DM, -1, sender->nick, to, 0, dm->data, dm->size);
+    internRelease(to);
+    if (target && target->acks) {
+        // Numbered copy, kept until the target acknowledges it.
+        clientWriteChunk(target, ackWindowAdd(target->acks, p + 3,
+                                              dm->size - 3));
+        if (!timerIsArmed(&target->acktimer))
+            timerSet(&target->acktimer, ACK_TIMEOUT * 1000);
+    } else if (target) {
+        // Send the DM to the target client only
+        clientWriteChunk(target, dm);
+    } else {
+        offlineQueueAdd(target_hash, dm, 1);
+        clientWriteString(sender, "User not connected, the message will be "
+                                  "delivered when they are back\n");
+    }
+    chunkRelease(dm);
+}
+
+/* Send again all the DMs the client did not acknowledge. */
+void clientRetransmit(struct client *c)
+{
+    struct ackWindow *w = c->acks;
+    for (int j = 0; j < w->count; j++)
+        clientWriteChunk(c, w->entries[(w->first + j) % ACK_WINDOW].msg);
+    w->sent = Clock.unixtime;
+    Acks.retransmitted += w->count;
+    timerSet(&c->acktimer, ACK_TIMEOUT * 1000);
+}
+
+/* Check if the oldest unacknowledged DM of the client waited too long.
+ * Only when the client read everything we sent, yet did not acknowledge
+ * it, it was probably lost, and the window is sent again. */
+void clientAckTimer(struct timer *t)
+{
+    struct client *c = t->privdata;
+    struct ackWindow *w = c->acks;
+    if (w == NULL || w->count == 0)
+        return;
+    time_t waited = Clock.unixtime - w->sent;
+    if (c->outq.len == 0 && waited >= ACK_TIMEOUT)
+        clientRetransmit(c);
+    else if (c->outq.len)
+        timerSet(t, 1000);
+    else
+        timerSet(t, (ACK_TIMEOUT - waited) * 1000);
+}
+
+/* Implements /ack on, that makes DMs numbered and acknowledged, and
+ * /ack <id>, that acknowledges all the DMs up to 'id'. */
+void ackCommand(struct client *c, char *arg)
+{
+    if (!strcmp(arg, "on"))
+    {
+        if (c->acks == NULL)
+            c->acks = ackWindowCreate();
+        clientWriteString(c, "DMs are now numbered, "
+                             "use /ack <id> to acknowledge them\n");
+        return;
+    }
+    char *end;
+    uint64_t id = strtoull(arg, &end, 10);
+    if (c->acks == NULL || *end != 0 || end == arg)
+    {
+        clientWriteString(c, "Usage: /ack on, then /ack <id>\n");
+        return;
+    }
+    ackWindowAck(c->acks, id); // Silent: acks can be very frequent.
+}
+
+/* Send to the client the DMs that were queued for its nick while nobody
+ * was using it, all in a single write. */
+void deliverOfflineMessages(struct client *c)
+{
+    struct chunk *ch = offlineTake(internHash(c->nick));
+    if (ch == NULL)
+        return;
+    clientWriteChunk(c, ch);
+    chunkRelease(ch);
+}
+
+/* Implements /session <token>: turn this connection into the one the
+ * session belonged to. The client gets back the nick and the rooms, and
+ * just the messages it missed while disconnected. If the old connection
+ * is still there (it dropped, but we did not notice yet) it is closed. */
+void sessionCommand(struct client *c, char *arg)
+{
+    struct session *s = sessionFind(arg);
+    if (s == NULL)
+    {
+        clientWriteString(c, "Unknown or expired session\n");
+        return;
+    }
+    if (s == c->session)
+    {
+        clientWriteString(c, "This is already your session\n");
+        return;
+    }
+    if (s->c)
+    {
+        struct client *old = s->c;
+        sessionDetach(old);
+        old->flags |= CLIENT_CLOSE_ASAP;
+        setAdd(&Chat->pendingwrite, old->fd); // Freed before sleeping.
+    }
+    sessionFree(c->session); // The token we sent is no longer valid.
+    sessionUnlink(s);
+    s->c = c;
+    c->session = s;
+    Sessions.restored++;
+
+    roomPartAll(c);
+    internRelease(c->nick);
+    c->nick = s->nick;
+    s->nick = -1; // Now owned by the client.
+    char reply[128];
+    int replylen = snprintf(reply, sizeof(reply),
+                            "Session restored, welcome back %s\n",
+                            internStr(c->nick));
+    clientWrite(c, reply, replylen);
+    for (int j = 0; j < s->numrooms; j++)
+    {
+        struct room *r = roomJoin(c, internStr(s->rooms[j]),
+                                  internLen(s->rooms[j]), NULL);
+        roomResume(c, r, s->seen[j]);
+    }
+    c->room = s->room;
+    if (s->acks)
+    {
+        /* What was sent to this connection before the restore is
+         * queued for the nick, like the DMs of any dropped window. */
+        if (c->acks)
+            ackWindowFree(c->acks, internHash(c->nick));
+        c->acks = s->acks;
+        s->acks = NULL;
+        clientRetransmit(c);
+    }
+    sessionClear(s);
+    deliverOfflineMessages(c);
+}
+
+/* Flow control. Output queues let a fast sender queue messages for the
+ * members of a room much faster than they read them, and the memory used
+ * for that grows with the number of members. Both the total output queued
+ * and the output queued for the members of every room are tracked: when
+ * one of them is over its high watermark, the senders producing the most
+ * output are no longer read. Their buffered lines wait, and since we
+ * don't read their socket, TCP makes them slow down, without losing
+ * anything. Once the backlogs are below the low watermarks, they are
+ * read again, see handleFlowPausedClients().
+ *
+ * The sender of a room message that caused 'fanout' bytes of output is
+ * paused if a backlog is too high, and it sent many messages recently:
+ * clients chatting normally are never paused. */
+void flowControl(struct client *c, struct room *r, size_t fanout)
+{
+    time_t elapsed = Clock.unixtime - c->fanouttime;
+    c->fanout = elapsed >= 64 ? 0 : c->fanout >> elapsed;
+    c->fanouttime = Clock.unixtime;
+    c->fanout += fanout;
+    if (c->fanout < FLOW_NOISY_BYTES ||
+        (Chat->backlog <= FLOW_HIGH_WATERMARK &&
+         r->backlog <= FLOW_ROOM_HIGH_WATERMARK))
+        return;
+    c->flags |= CLIENT_FLOW_PAUSED;
+    setAdd(&Chat->flowpaused, c->fd);
+    Chat->stat_flow_pauses++;
+}
+
+/* Process a line received from the client, without the trailing newline.
+ * If the user message starts with "/", we process it as a client command,
+ * otherwise it is a message for all the other clients in the chat. */
+void processLine(struct client *c, char *line, size_t len)
+{
+    if (line[0] == '/')
+    {
+        /* Check for an argument of the command, after
+         * the space. */
+        char *arg = strchr(line, ' ');
+        if (arg)
+        {
+            *arg = 0; /* Terminate command name. */
+            arg++;    /* Argument is 1 byte after the space. */
+        }
+
+        if (!strcmp(line, "/nick") && arg)
+        {
+            int newnick = internGet(arg, strlen(arg)); // Intern the new nick.
+            internRelease(c->nick); // Drop the old one.
+            c->nick = newnick;
+            deliverOfflineMessages(c);
+        }
+        else if (!strcmp(line, "/list"))
+        {
+            // list each client name, one per line
+            char listmsg[256];
+            struct clientSet *active = &Chat->active;
+            for (int i = setNext(active, 0); i != -1; i = setNext(active, i + 1)) {
+                int id = Chat->clients[i]->nick;
+                clientWrite(c, internStr(id), internLen(id));
+                clientWrite(c, "\n", 1);
+            }
+            // send the number of connected users to the client
+            int msglen = snprintf(listmsg, sizeof(listmsg), "Number of connected users: %d\n", Chat->numclients);
+            clientWrite(c, listmsg, msglen);
+        }
+        else if (!strcmp(line, "/dm"))
+        {
+            char *target_nick = strtok(arg, " "); // Get the first token after "/dm" as the target nickname
+            char *message = strtok(NULL, ""); // Get the rest of the input as the message
+
+            // Check if we got a target nickname and a message
+            if (target_nick == NULL || message == NULL) {
+                clientWriteString(c, "Error: The format is /dm <nickname> <message>\n");
+                return; // Wait for a new message
+            }
+            // Call a function to handle DM
+            handleDirectMessage(c, target_nick, message);
+        }
+        else if (!strcmp(line, "/join") && arg)
+        {
+            if (arg[0] == '#')
+                arg++; // "#room" and "room" are the same room.
+            size_t roomlen = strlen(arg);
+            if (roomlen == 0 || roomlen > MAX_ROOM_LEN || strchr(arg, ' '))
+            {
+                clientWriteString(c, "Invalid room name\n");
+                return;
+            }
+            int joined;
+            struct room *r = roomJoin(c, arg, roomlen, &joined);
+            char reply[128];
+            int replylen = snprintf(reply, sizeof(reply),
+                                    "Joined #%s, %d members, last seq %llu\n",
+                                    internStr(r->name), r->nummembers,
+                                    (unsigned long long)r->seq);
+            clientWrite(c, reply, replylen);
+            if (joined)
+                historyReplay(c, r);
+        }
+        else if (!strcmp(line, "/part"))
+        {
+            /* Leave the named room, or the current one. */
+            struct room *r = NULL;
+            if (arg && arg[0] == '#')
+                arg++;
+            int id = arg ? internLookup(arg, strlen(arg)) : c->room;
+            if (id != -1)
+                r = roomLookup(id);
+            if (r == NULL || !clientInRoom(c, r))
+            {
+                clientWriteString(c, "You are not in that room\n");
+                return;
+            }
+            roomPart(c, r);
+            clientWriteString(c, "Left the room\n");
+        }
+        else if (!strcmp(line, "/rooms"))
+        {
+            /* The rooms this client joined, the current one first. */
+            for (int j = c->numrooms - 1; j >= 0; j--)
+            {
+                struct room *r = roomLookup(c->rooms[j]);
+                char reply[128];
+                int replylen = snprintf(reply, sizeof(reply),
+                                        "#%s (%d members)%s\n",
+                                        internStr(r->name), r->nummembers,
+                                        r->name == c->room ? " *" : "");
+                clientWrite(c, reply, replylen);
+            }
+        }
+        else if (!strcmp(line, "/history"))
+        {
+            historyCommand(c, arg);
+        }
+        else if (!strcmp(line, "/search"))
+        {
+            searchCommand(c, arg);
+        }
+        else if (!strcmp(line, "/resume"))
+        {
+            resumeCommand(c, arg);
+        }
+        else if (!strcmp(line, "/ack") && arg)
+        {
+            ackCommand(c, arg);
+        }
+        else if (!strcmp(line, "/session") && arg)
+        {
+            sessionCommand(c, arg);
+        }
+        else if (!strcmp(line, "/stats"))
+        {
+            /* Counters useful to benchmarks and monitoring. The loop CPU
+             * time includes the kernel time spent in poll(), that with
+             * many idle clients is where most of the cost is. */
+            char stats[2048];
+            int statslen = snprintf(stats, sizeof(stats),
+                "clients:%d loops:%llu loop_cpu_usec:%llu "
+                "log_segments:%d log_next_id:%llu log_fsyncs:%llu "
+                "sendfile_bytes:%llu offline_queued:%llu "
+                "offline_delivered:%llu offline_expired:%llu "
+                "offline_refused:%llu offline_skipped:%llu "
+                "sessions:%zu sessions_restored:%llu sessions_expired:%llu "
+                "dm_acked:%llu dm_retransmitted:%llu dm_refused:%llu "
+                "dm_dropped:%llu backlog_bytes:%zu flow_paused:%d "
+                "flow_pauses:%llu read_deferred:%llu rejected:%llu "
+                "snapshots:%llu snapshot_failures:%llu "
+                "snapshot_in_progress:%d snapshot_bytes:%lld "
+                "snapshot_ms:%lld snapshot_cow_bytes:%lld fork_usec:%lld\n",
+                Chat->numclients, Chat->stat_loops, Chat->stat_loop_cpu_us,
+                Log.numsegments, (unsigned long long)Log.nextid,
+                (unsigned long long)Log.fsyncs, Chat->stat_sendfile_bytes,
+                (unsigned long long)Offline.queued,
+                (unsigned long long)Offline.delivered,
+                (unsigned long long)Offline.expired,
+                (unsigned long long)Offline.refused,
+                (unsigned long long)Offline.skipped, Sessions.table.used,
+                (unsigned long long)Sessions.restored,
+                (unsigned long long)Sessions.expired,
+                (unsigned long long)Acks.acked,
+                (unsigned long long)Acks.retransmitted,
+                (unsigned long long)Acks.refused,
+                (unsigned long long)Acks.dropped, Chat->backlog,
+                setCount(&Chat->flowpaused), Chat->stat_flow_pauses,
+                Chat->stat_read_deferred, Chat->stat_rejected,
+                (unsigned long long)Snapshot.saved,
+                (unsigned long long)Snapshot.failed, Snapshot.pid != -1,
+                (long long)Snapshot.last.bytes, (long long)Snapshot.last.ms,
+                (long long)Snapshot.last.cowbytes,
+                (long long)Snapshot.forkus);
+            clientWrite(c, stats, statslen);
+        }
+        else
+        {
+            /* Unsupported command. Send an error. */
+            clientWriteString(c, "Unsupported command\n");
+        }
+    }
+    else
+    {
+        if (c->room == -1)
+        {
+            clientWriteString(c, "You are not in any room, "
+                                 "use /join <room> to enter one\n");
+            return;
+        }
+
+        /* Create a message to send to the room (and show
+         * on the server console) in the form:
+         *   #room:seq nick> some message.
+         * Every message of a room has the next sequence number, so
+         * clients can tell if they missed something. */
+        struct room *r = roomLookup(c->room);
+        uint64_t seq = ++r->seq;
+        char seqstr[24];
+        size_t seqlen = snprintf(seqstr, sizeof(seqstr), ":%llu",
+                                 (unsigned long long)seq);
+        size_t roomlen = internLen(c->room);
+        size_t nicklen = internLen(c->nick);
+        size_t msglen = 1 + roomlen + seqlen + 1 + nicklen + 2 + len + 1;
+        char *msg = chatMalloc(msglen), *p = msg;
+        *p++ = '#';
+        memcpy(p, internStr(c->room), roomlen);
+        p += roomlen;
+        memcpy(p, seqstr, seqlen);
+        p += seqlen;
+        *p++ = ' ';
+        memcpy(p, internStr(c->nick), nicklen);
+        p += nicklen;
+        memcpy(p, "> ", 2);
+        p += 2;
+        memcpy(p, line, len);
+        msg[msglen - 1] = '\n';
+        printf("%.*s", (int)msglen, msg);
+
+        /* Send it to all the other members of the room. */
+        sendMsgToRoomBut(r, c->fd, c->nick, seq, msg, msglen);
+        free(msg);
+        clientUpdateSeen(c); // Its own message counts as received.
+        flowControl(c, r, msglen * (r->nummembers - 1));
+    }
+}
+
+/* Process every complete line in the input buffer of the client, as long
+ * as it is within its rate limits. A partial line stays buffered until
+ * the rest arrives, but lines longer than MAX_LINE_LEN are processed in
+ * pieces.
+ *
+ * A client that pasted a lot of lines doesn't get to run them all while
+ * the others wait: after READ_BUDGET_LINES lines or READ_BUDGET_BYTES
+ * bytes we stop, and the client goes in the 'pendingread' set, to process
+ * the rest in the next iteration of the event loop. Meanwhile its socket
+ * is not read, so the input buffer doesn't grow. */
+void processInputBuffer(struct client *c)
+{
+    char line[MAX_LINE_LEN + 1];
+    int budgetlines = READ_BUDGET_LINES;
+    size_t budgetbytes = READ_BUDGET_BYTES;
+
+    if (Shutdown.active)
+        return; // Nothing new is accepted.
+    setDel(&Chat->pendingread, c->fd);
+    while (c->inbuf.len &&
+           !(c->flags & (CLIENT_CLOSE_ASAP | CLIENT_FLOW_PAUSED)))
+    {
+        if (budgetlines == 0 || budgetbytes == 0)
+        {
+            setAdd(&Chat->pendingread, c->fd);
+            Chat->stat_read_deferred++;
+            break;
+        }
+        ssize_t nl = cbufFind(&c->inbuf, '\n');
+        size_t len, consume;
+        if (nl == -1)
+        {
+            if (c->inbuf.len < MAX_LINE_LEN)
+                break; // Wait for the rest of the line.
+            len = consume = MAX_LINE_LEN;
+        }
+        else
+        {
+            len = nl < MAX_LINE_LEN ? (size_t)nl : MAX_LINE_LEN;
+            consume = nl + 1;
+        }
+        int64_t wait = rateCheck(c, consume);
+        if (wait && !Config.ratereject)
+        {
+            /* Stop reading: the line stays buffered, and is processed
+             * when the client has enough tokens again. */
+            c->flags |= CLIENT_RATE_LIMITED;
+            timerSet(&c->ratetimer, wait);
+            break;
+        }
+        if (wait)
+        {
+            cbufConsume(&c->inbuf, consume);
+            if (!(c->flags & CLIENT_RATE_NOTIFIED))
+                clientWriteString(c, "Rate limit exceeded, "
+                                     "messages are being dropped\n");
+            c->flags |= CLIENT_RATE_NOTIFIED;
+            continue;
+        }
+        c->flags &= ~CLIENT_RATE_NOTIFIED;
+        budgetlines--;
+        budgetbytes -= consume < budgetbytes ? consume : budgetbytes;
+        cbufPeek(&c->inbuf, line, len);
+        cbufConsume(&c->inbuf, consume);
+        if (len && line[len - 1] == '\r')
+            len--; // Remove the "\r" of "\r\n" terminated lines.
+        if (len == 0)
+            continue;
+        line[len] = 0;
+        processLine(c, line, len);
+    }
+    /* A partial line: check later if the client ever sends the rest. */
+    if (c->inbuf.len)
+    {
+        int secs = IDLE_BUFFER_TIME;
+        if (Config.timeout && Config.timeout < secs)
+            secs = Config.timeout;
+        timerSet(&c->idletimer, secs * 1000);
+    }
+}
+
+/* Process the input left by clients that were over their read budget
+ * in the previous iteration of the event loop, starting from the one
+ * main() serves first, like it does for the clients with new data. */
+void handlePendingReads(void)
+{
+    struct clientSet *pending = &Chat->pendingread;
+    int start = Chat->dispatchstart;
+    for (int j = setNext(pending, start); j != -1; j = setNext(pending, j + 1))
+        processInputBuffer(Chat->clients[j]);
+    for (int j = setNext(pending, 0); j != -1 && j < start;
+         j = setNext(pending, j + 1))
+        processInputBuffer(Chat->clients[j]);
+}
+
+/* Read again the clients paused by flowControl() if the backlogs of all
+ * their rooms drained enough. */
+void handleFlowPausedClients(void)
+{
+    if (Chat->backlog > FLOW_LOW_WATERMARK)
+        return;
+    struct clientSet *paused = &Chat->flowpaused;
+    for (int j = setNext(paused, 0); j != -1; j = setNext(paused, j + 1))
+    {
+        struct client *c = Chat->clients[j];
+        int k;
+        for (k = 0; k < c->numrooms; k++)
+            if (roomLookup(c->rooms[k])->backlog > FLOW_ROOM_LOW_WATERMARK)
+                break;
+        if (k < c->numrooms)
+            continue;
+        c->flags &= ~CLIENT_FLOW_PAUSED;
+        setDel(paused, j);
+        processInputBuffer(c); // What it sent while paused.
+    }
+}
+
+/* Read what the client sent us into its input buffer, then process every
+ * complete line. The client may be freed by this function.
+ *
+ * Memory for the input buffer is only taken when data arrives, and since
+ * most of the times we process everything we read, it goes back to the
+ * pool immediately. The read size adapts to the client: it starts small,
+ * doubles every time a read fills all the space we offered (the client is
+ * pasting or sending a burst), and halves when reads get small again. */
+void readFromClient(struct client *c)
+{
+    struct iovec iov[2];
+    int iovcnt = cbufPrepareRead(&c->inbuf, c->readlen, iov);
+    size_t room = 0;
+    for (int j = 0; j < iovcnt; j++)
+        room += iov[j].iov_len;
+    ssize_t nread = readv(c->fd, iov, iovcnt);
+    if (nread == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        cbufCommitRead(&c->inbuf, 0); // Nothing to read after all.
+        return;
+    }
+    if (nread <= 0)
+    {
+        /* Error or short read means that the socket
+         * was closed. */
+        printf("Disconnected client fd=%d, nick=%s\n",
+               c->fd, internStr(c->nick));
+        freeClient(c);
+        return;
+    }
+    cbufCommitRead(&c->inbuf, nread);
+    c->lastinput = Clock.unixtime;
+    if ((size_t)nread == room && c->readlen < READ_LEN_MAX)
+        c->readlen *= 2;
+    else if ((size_t)nread < c->readlen / 4 && c->readlen > READ_LEN_MIN)
+        c->readlen /= 2;
+    processInputBuffer(c);
+}
+
+/* Called when the idle timer of the client fires: disconnect the client
+ * if it was idle more than Config.timeout seconds, release the memory of
+ * its input buffer if it waits for the rest of a line since a while. The
+ * timer is not moved every time the client sends something: when it
+ * fires it checks how long the client was really idle, and is armed again
+ * for what remains. */
+void clientIdleTimer(struct timer *t)
+{
+    struct client *c = t->privdata;
+    time_t idle = Clock.unixtime - c->lastinput;
+    if (Config.timeout && idle >= Config.timeout)
+    {
+        printf("Client fd=%d, nick=%s timed out\n", c->fd, internStr(c->nick));
+        c->flags |= CLIENT_CLOSE_ASAP;
+        setAdd(&Chat->pendingwrite, c->fd); // Freed before sleeping.
+        return;
+    }
+    if (c->inbuf.len && idle >= IDLE_BUFFER_TIME)
+        cbufCompact(&c->inbuf);
+
+    time_t next = Config.timeout ? Config.timeout - idle : 0;
+    if (c->inbuf.len && idle < IDLE_BUFFER_TIME &&
+        (next == 0 || IDLE_BUFFER_TIME - idle < next))
+        next = IDLE_BUFFER_TIME - idle;
+    if (next)
+        timerSet(t, next * 1000);
+}
+
+/* The client exceeded a rate limit and now has enough tokens for its next
+ * line: process what it sent meanwhile, and read from it again. */
+void clientRateTimer(struct timer *t)
+{
+    struct client *c = t->privdata;
+    c->flags &= ~CLIENT_RATE_LIMITED;
+    processInputBuffer(c);
+}
+
+/* Called once per second to do the things that don't depend on clients
+ * activity: releasing memory the pool doesn't need, expiring offline
+ * messages and sessions, syncing the log. What depends on a client is
+ * done by the timers of the client, so that idle clients cost nothing
+ * here. */
+void serverCron(void)
+{
+    time_t now = Clock.unixtime;
+    chunkPoolTrim();
+    offlineCron(now);
+    sessionCron(now);
+    logCron();
+    snapshotCron(now);
+}
+
+void cronTimer(struct timer *t)
+{
+    serverCron();
+    timerSet(t, 1000);
+}
+
+/* =============================== Live upgrade =================================
+ * Restarting the server to run a new binary would disconnect everybody,
+ * and then all the clients would reconnect at the same time. Instead, on
+ * SIGUSR2 the server forks and executes its binary again (the new one, if
+ * it was replaced on disk) with --upgrade-fd, passing it one end of a Unix
+ * socket. Over that socket the old process sends the listening socket and
+ * the sockets of all the clients, as SCM_RIGHTS ancillary data, followed by
+ * the chat state: rooms with their history; clients with nick, session,
+ * rooms, unprocessed input and unsent output; detached sessions; offline
+ * DMs. The new process rebuilds everything and confirms, then the old one
+ * just exits. Clients don't notice: what they send meanwhile waits in the
+ * kernel socket buffers, and the new process reads it.
+ *
+ * The message log is flushed before the fork, and the new process loads
+ * it as usual. If anything goes wrong before the confirmation, the old
+ * process kills the new one and goes on serving.
+ *
+ * A /history or /search running during the upgrade is cut short: the
+ * client gets what was already queued for it, but not the rest.
+
+ * =========================================================================== */
+
+#define UPGRADE_MAGIC 0x3150555443534dULL // Version of the format.
+#define UPGRADE_FDS_PER_MSG 64            // Descriptors per sendmsg().
+#define UPGRADE_TIMEOUT 10                // Seconds for the new process.
+
+struct upgradeState
+{
+    volatile sig_atomic_t requested; // Set by the SIGUSR2 handler.
+    char **argv;                     // To execute the binary again.
+};
+
+struct upgradeState Upgrade;
+
+/* A client is saved with everything needed to go on as if nothing
+ * happened. Its socket is passed separately, in the same order. */
+void upgradeSaveClient(struct logBuffer *b, struct client *c)
+{
+    statePutU64(b, c->ip->addr);
+    statePutStr(b, internStr(c->nick), internLen(c->nick));
+    statePutStr(b, (char *)c->session->token, SESSION_TOKEN_LEN);
+    statePutU64(b, c->lastinput);
+    statePutRoomName(b, c->room);
+    statePutU64(b, c->numrooms);
+    for (int j = 0; j < c->numrooms; j++)
+    {
+        statePutStr(b, internStr(c->rooms[j]), internLen(c->rooms[j]));
+        statePutU64(b, c->seen[j]);
+    }
+    stateSaveAcks(b, c->acks);
+    statePutBuf(b, &c->inbuf);
+    /* Output held during a /history goes after what is in the queue. */
+    statePutBuf(b, &c->outq);
+    statePutBuf(b, &c->held);
+}
+
+/* Create the client connected to 'fd' saved by upgradeSaveClient(). */
+void upgradeLoadClient(struct stateReader *rd, int fd)
+{
+    uint32_t addr = stateGetU64(rd);
+    struct client *c = createClient(fd, addr);
+    internRelease(c->nick);
+    c->nick = stateGetIntern(rd);
+    unsigned char token[SESSION_TOKEN_LEN];
+    if (stateGetToken(rd, token) == 0)
+        sessionSetToken(c->session, token);
+    c->lastinput = stateGetU64(rd);
+    int room = stateGetRoomName(rd);
+    uint64_t numrooms = stateGetU64(rd);
+    for (uint64_t j = 0; j < numrooms && !rd->err; j++)
+    {
+        size_t len;
+        const char *name = stateGetStr(rd, &len);
+        roomJoin(c, name, len, NULL);
+        c->seen[c->numrooms - 1] = stateGetU64(rd);
+    }
+    c->room = c->numrooms ? room : -1;
+    c->acks = stateLoadAcks(rd);
+    if (c->acks && c->acks->count)
+        timerSet(&c->acktimer, ACK_TIMEOUT * 1000);
+
+    size_t len;
+    const char *p = stateGetStr(rd, &len);
+    if (len)
+    {
+        cbufAppend(&c->inbuf, p, len);
+        setAdd(&Chat->pendingread, fd); // Processed in the next iteration.
+    }
+    for (int j = 0; j < 2; j++) // The output queue, then the held output.
+    {
+        p = stateGetStr(rd, &len);
+        if (len)
+            clientWrite(c, p, len);
+    }
+}
+
+/* Send the descriptors 'fds' over the Unix socket 'sock', in batches
+ * preceded by their count. A zero count ends the list. */
+int upgradeSendFds(int sock, int *fds, int count)
+{
+    int sent = 0;
+    while (1)
+    {
+        uint32_t n = count - sent;
+        if (n > UPGRADE_FDS_PER_MSG)
+            n = UPGRADE_FDS_PER_MSG;
+        char control[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+        struct iovec iov = {&n, sizeof(n)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (n)
+        {
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+            memcpy(CMSG_DATA(cmsg), fds + sent, sizeof(int) * n);
+        }
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(n))
+            return -1;
+        if (n == 0)
+            return 0;
+        sent += n;
+    }
+}
+
+/* Receive the descriptors sent by upgradeSendFds(). Return their number,
+ * setting '*fds' to a new array, or -1 on errors. */
+int upgradeRecvFds(int sock, int **fds)
+{
+    int count = 0;
+    *fds = NULL;
+    while (1)
+    {
+        uint32_t n;
+        char control[CMSG_SPACE(sizeof(int) * UPGRADE_FDS_PER_MSG)];
+        struct iovec iov = {&n, sizeof(n)};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &msg, 0) != sizeof(n) || n > UPGRADE_FDS_PER_MSG)
+            return -1;
+        if (n == 0)
+            return count;
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(int) * n))
+            return -1;
+        *fds = chatRealloc(*fds, sizeof(int) * (count + n));
+        memcpy(*fds + count, CMSG_DATA(cmsg), sizeof(int) * n);
+        count += n;
+    }
+}
+
+/* Send the listening socket, the clients and the state to the new
+ * process over 'sock'. Return the number of clients sent, or -1 on
+ * errors. Clients that are not live are left to us: they are closed when
+ * we exit. */
+int upgradeSend(int sock)
+{
+    int *fds = chatMalloc(sizeof(int) * (Chat->numclients + 1));
+    int numfds = 0;
+    struct logBuffer b = {NULL, 0, 0};
+
+    fds[numfds++] = Chat->serversock;
+    struct clientSet *active = &Chat->active;
+    for (int j = setNext(active, 0); j != -1; j = setNext(active, j + 1))
+    {
+        if (clientIsLive(Chat->clients[j]))
+            fds[numfds++] = j;
+    }
+    statePutU64(&b, UPGRADE_MAGIC);
+    stateSaveRooms(&b);
+    statePutU64(&b, numfds - 1);
+    for (int j = 1; j < numfds; j++)
+        upgradeSaveClient(&b, Chat->clients[fds[j]]);
+    stateSaveSessions(&b, 0);
+    stateSaveOffline(&b);
+
+    uint64_t len = b.len;
+    int retval = upgradeSendFds(sock, fds, numfds);
+    if (retval == 0 &&
+        send(sock, &len, sizeof(len), MSG_NOSIGNAL) != sizeof(len))
+        retval = -1;
+    for (size_t sent = 0; retval == 0 && sent < b.len;)
+    {
+        ssize_t nwritten = send(sock, b.p + sent, b.len - sent, MSG_NOSIGNAL);
+        if (nwritten == -1 && errno != EINTR)
+            retval = -1;
+        if (nwritten > 0)
+            sent += nwritten;
+    }
+    free(fds);
+    free(b.p);
+    return retval == 0 ? numfds - 1 : -1;
+}
+
+/* In the child: execute the binary again, with the socket to receive the
+ * state as descriptor 3 and every other descriptor closed. Only system
+ * calls here, since other threads may hold locks in the parent. */
+void upgradeExec(int sock)
+{
+    if (dup2(sock, 3) == -1)
+        _exit(1);
+    closeFrom(4);
+    execvp(Upgrade.argv[0], Upgrade.argv);
+    _exit(1);
+}
+
+/* SIGUSR2 was received: hand everything to a new process and exit, or
+ * go on serving if that fails. */
+void upgradeStart(void)
+{
+    Upgrade.requested = 0;
+    printf("Upgrade requested, executing %s\n", Upgrade.argv[0]);
+    fflush(stdout);
+    logFlush(); // The new process will load the log.
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+    {
+        perror("Upgrade socketpair");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0)
+        upgradeExec(sv[1]);
+    close(sv[1]);
+    if (pid == -1)
+    {
+        perror("Upgrade fork");
+        close(sv[0]);
+        return;
+    }
+
+    struct timeval tv = {UPGRADE_TIMEOUT, 0};
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    char ok;
+    int moved = upgradeSend(sv[0]);
+    if (moved != -1 && read(sv[0], &ok, 1) == 1)
+    {
+        printf("Upgrade done, %d clients moved to process %d\n",
+               moved, (int)pid);
+        exit(0);
+    }
+    fprintf(stderr, "Upgrade failed, going on with this process\n");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(sv[0]);
+}
+
+/* Started with --upgrade-fd: receive the listening socket, the clients
+ * and the state from the old process. */
+void upgradeLoad(void)
+{
+    int sock = Config.upgradefd, *fds;
+    int numfds = upgradeRecvFds(sock, &fds);
+    uint64_t len;
+    char *state = NULL;
+    if (numfds < 1 ||
+        recv(sock, &len, sizeof(len), MSG_WAITALL) != sizeof(len))
+        goto err;
+    state = chatMalloc(len);
+    if (recv(sock, state, len, MSG_WAITALL) != (ssize_t)len)
+        goto err;
+
+    struct stateReader rd = {state, len, 0};
+    if (stateGetU64(&rd) != UPGRADE_MAGIC)
+        goto err;
+    Chat->serversock = fds[0];
+    stateLoadRooms(&rd);
+    if (stateGetU64(&rd) != (uint64_t)numfds - 1)
+        goto err;
+    for (int j = 1; j < numfds && !rd.err; j++)
+    {
+        upgradeLoadClient(&rd, fds[j]);
+    }
+    stateLoadSessions(&rd, 0);
+    stateLoadOffline(&rd);
+    if (rd.err || write(sock, "K", 1) != 1)
+        goto err;
+    printf("Upgrade: %d clients, %zu rooms, %zu sessions restored\n",
+           Chat->numclients, Chat->rooms.used, Sessions.table.used);
+    close(sock);
+    free(state);
+    free(fds);
+    return;
+
+err:
+    /* The old process is still serving: just go away. */
+    fprintf(stderr, "Upgrade: can't load the state of the old process\n");
+    exit(1);
+}
+
+void upgradeSignalHandler(int sig)
+{
+    (void)sig;
+    Upgrade.requested = 1;
+}
+
+/* Remember how to execute ourselves again, and handle SIGUSR2. */
+void upgradeInit(int argc, char **argv)
+{
+    Upgrade.argv = chatMalloc(sizeof(char *) * (argc + 3));
+    int argn = 0;
+    for (int j = 0; j < argc; j++)
+    {
+        if (!strcmp(argv[j], "--upgrade-fd") && j + 1 < argc)
+            j++; // Only meant for this process.
+        else
+            Upgrade.argv[argn++] = argv[j];
+    }
+    Upgrade.argv[argn++] = "--upgrade-fd";
+    Upgrade.argv[argn++] = "3";
+    Upgrade.argv[argn] = NULL;
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = upgradeSignalHandler;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGUSR2, &act, NULL); // No SA_RESTART: wake up poll().
+    signal(SIGPIPE, SIG_IGN); // A failed handoff must not kill us.
+}
+
+/* Parse the command line options into Config. */
+void parseOptions(int argc, char **argv)
+{
+    for (int j = 1; j < argc; j++)
+    {
+        int more = j + 1 < argc; // There is an argument after this one.
+        if (!strcmp(argv[j], "--port") && more)
+        {
+            Config.port = atoi(argv[++j]);
+        }
+        else if (!strcmp(argv[j], "--log-dir") && more)
+        {
+            Config.logdir = argv[++j];
+        }
+        else if (!strcmp(argv[j], "--timeout") && more)
+        {
+            Config.timeout = atoi(argv[++j]);
+        }
+        else if (!strcmp(argv[j], "--timestamp-ms"))
+        {
+            Config.timestampms = 1;
+        }
+        else if (!strcmp(argv[j], "--rate") && j + 2 < argc)
+        {
+            Config.ratemsgs = atoi(argv[++j]);
+            Config.ratebytes = atoi(argv[++j]);
+        }
+        else if (!strcmp(argv[j], "--ip-rate") && j + 2 < argc)
+        {
+            Config.ipratemsgs = atoi(argv[++j]);
+            Config.ipratebytes = atoi(argv[++j]);
+        }
+        else if (!strcmp(argv[j], "--rate-reject"))
+        {
+            Config.ratereject = 1;
+        }
+        else if (!strcmp(argv[j], "--max-clients") && more)
+        {
+            Config.maxclients = atoi(argv[++j]);
+            if (Config.maxclients <= 0)
+            {
+                fprintf(stderr, "--max-clients must be at least 1\n");
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[j], "--max-clients-per-ip") && more)
+        {
+            Config.maxperip = atoi(argv[++j]);
+        }
+        else if (!strcmp(argv[j], "--shutdown-timeout") && more)
+        {
+            Config.shutdowntimeout = atoi(argv[++j]);
+        }
+        else if (!strcmp(argv[j], "--snapshot") && more)
+        {
+            Config.snapshot = argv[++j];
+        }
+        else if (!strcmp(argv[j], "--snapshot-interval") && more)
+        {
+            Config.snapshotinterval = atoi(argv[++j]);
+        }
+        else if (!strcmp(argv[j], "--upgrade-fd") && more)
+        {
+            Config.upgradefd = atoi(argv[++j]);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--port <port>] [--log-dir <dir>] "
+                            "[--timeout <seconds>] [--timestamp-ms]\n"
+                            "       [--rate <lines/s> <bytes/s>] "
+                            "[--ip-rate <lines/s> <bytes/s>] "
+                            "[--rate-reject]\n"
+                            "       [--max-clients <count>] "
+                            "[--max-clients-per-ip <count>]\n"
+                            "       [--shutdown-timeout <seconds>] "
+                            "[--snapshot <file>] "
+                            "[--snapshot-interval <seconds>]\n",
+                            argv[0]);
+            exit(1);
+        }
+    }
+}
+
+/* Create the client for the connection 'fd' just accepted, and send it
+ * the welcome message, with the session token. */
+void welcomeClient(int fd, uint32_t addr)
+{
+    struct client *c = createClient(fd, addr);
+    char token[SESSION_TOKEN_LEN * 2 + 1], welcome[256];
+    sessionToken(c->session, token);
+    int welcomelen = snprintf(welcome, sizeof(welcome),
+        "Welcome to Simple Chat! "
+        "Use /nick <nick> to set your nick.\n"
+        "Your session is %s, use /session <token> after "
+        "a reconnection to restore it.\n", token);
+    clientWrite(c, welcome, welcomelen);
+    clientJoinRoom(c, DEFAULT_ROOM, strlen(DEFAULT_ROOM));
+    printf("Connected client fd=%d\n", fd);
+}
+
+/* Every client needs a descriptor: raise the open files limit so that
+ * --max-clients clients fit, plus FD_RESERVE descriptors for the rest. If
+ * the hard limit doesn't allow it, an explicit --max-clients is an error,
+ * while the default is lowered to what fits. */
+void setupOpenFilesLimit(void)
+{
+    int explicit = Config.maxclients != 0;
+    if (!explicit)
+        Config.maxclients = DEFAULT_MAX_CLIENTS;
+    rlim_t needed = (rlim_t)Config.maxclients + FD_RESERVE;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur >= needed)
+        return;
+    rlim_t oldlimit = rl.rlim_cur;
+    rl.rlim_cur = needed < rl.rlim_max ? needed : rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+        rl.rlim_cur = oldlimit;
+    if (rl.rlim_cur >= needed)
+        return;
+    if (explicit || rl.rlim_cur <= FD_RESERVE)
+    {
+        fprintf(stderr, "--max-clients %d needs %llu open files, but the "
+                        "limit is %llu (see ulimit -n)\n", Config.maxclients,
+                (unsigned long long)needed,
+                (unsigned long long)rl.rlim_cur);
+        exit(1);
+    }
+    Config.maxclients = rl.rlim_cur - FD_RESERVE;
+    printf("Open files limit is %llu: accepting at most %d clients\n",
+           (unsigned long long)rl.rlim_cur, Config.maxclients);
+}
+
+/* Add 'fd' to the descriptors poll() watches for 'events'. */
+void pollAdd(int fd, short events)
+{
+    if (Chat->numpollfds == Chat->pollcap)
+    {
+        Chat->pollcap = Chat->pollcap ? Chat->pollcap * 2 : 64;
+        Chat->pollfds = chatRealloc(Chat->pollfds,
+                                    sizeof(struct pollfd) * Chat->pollcap);
+    }
+    struct pollfd *pfd = Chat->pollfds + Chat->numpollfds++;
+    pfd->fd = fd;
+    pfd->events = events;
+    pfd->revents = 0;
+}
+
+/* Wait up to 'timeout' milliseconds for the descriptors added with
+ * pollAdd(), then move what poll() reported into the 'readable' and
+ * 'writable' sets, that the event loop checks like the bitmaps of
+ * select(). Errors and hang ups are reported as the events we asked for:
+ * the read() or write() that follows finds out what happened. Return the
+ * value of poll(). */
+int pollWait(int timeout)
+{
+    setClear(&Chat->readable);
+    setClear(&Chat->writable);
+    int retval = poll(Chat->pollfds, Chat->numpollfds, timeout);
+    for (int j = 0; retval > 0 && j < Chat->numpollfds; j++)
+    {
+        struct pollfd *pfd = Chat->pollfds + j;
+        short revents = pfd->revents;
+        if (revents & (POLLERR | POLLHUP | POLLNVAL))
+            revents |= pfd->events;
+        if (revents & pfd->events & POLLIN)
+            setAdd(&Chat->readable, pfd->fd);
+        if (revents & pfd->events & POLLOUT)
+            setAdd(&Chat->writable, pfd->fd);
+    }
+    Chat->numpollfds = 0;
+    return retval;
+}
+
+/* The main() function implements the main chat logic:
+ * 1. Accept new clients connections if any.
+ * 2. Check if any client sent us some new message.
+ * 3. Send the message to all the other clients. */
+int main(int argc, char **argv)
+{
+    parseOptions(argc, argv);
+    setupOpenFilesLimit();
+    upgradeInit(argc, argv);
+    shutdownInit();
+    initChat();
+    if (Config.upgradefd != -1)
+        upgradeLoad();
+    snapshotInit();
+
+    while (1)
+    {
+        int retval;
+        struct timespec cpu_start, cpu_end;
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+        if (Shutdown.signals && !Shutdown.active)
+            shutdownStart();
+        else if (Upgrade.requested && !Shutdown.active)
+            upgradeStart(); // Returns only if the upgrade failed.
+        if (Snapshot.requested)
+            snapshotStart();
+
+        /* Before sleeping, write what we queued for the clients during the
+         * previous iteration. Usually this is all it takes, and the
+         * clients don't need to wait for poll() to report them as
+         * writable. */
+        handlePendingReads();
+        handleHistoryQueries();
+        handleClientsWithPendingWrites();
+        handleFlowPausedClients();
+        logFlush();
+        if (Shutdown.active)
+            shutdownCheck();
+
+        /* When we want to be notified by poll() that there is
+         * activity? If the listening socket has pending clients to accept
+         * or if any other client wrote anything. We also want to know when
+         * clients with output still pending can accept more data. Unlike
+         * select(), poll() has no limit on the descriptor numbers. */
+        if (Chat->serversock != -1)
+            pollAdd(Chat->serversock, POLLIN);
+        pollAdd(Bio.pipefd[0], POLLIN); // Completed background jobs.
+
+        struct clientSet *active = &Chat->active;
+        for (int j = setNext(active, 0); j != -1; j = setNext(active, j + 1))
+        {
+            short events = setHas(&Chat->pendingwrite, j) ? POLLOUT : 0;
+            if (!(Chat->clients[j]->flags & CLIENT_READ_PAUSED) &&
+                !setHas(&Chat->pendingread, j) && !Shutdown.active)
+                events |= POLLIN; // Otherwise let its TCP window fill up.
+            if (events)
+                pollAdd(j, events);
+        }
+
+        /* Sleep until the next timer, unless a history query can send
+         * its next page, or a client has input left to process: then
+         * don't sleep at all. There is always the serverCron() timer, at
+         * most a second away. */
+        int64_t timeout = timerNextTimeout();
+        if (setNext(&Chat->pendingread, 0) != -1)
+            timeout = 0;
+        if (Shutdown.active && timeout > Shutdown.deadline - Clock.mstime)
+            timeout = Shutdown.deadline > Clock.mstime ?
+                      Shutdown.deadline - Clock.mstime : 0;
+        struct clientSet *querying = &Chat->querying;
+        for (int j = setNext(querying, 0); j != -1;
+             j = setNext(querying, j + 1))
+        {
+            if (Chat->clients[j]->outq.filelen == 0)
+                timeout = 0;
+        }
+        retval = pollWait(timeout);
+        clockUpdate(); // We may have slept, and everything below needs it.
+        if (retval == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll() error");
+            exit(1);
+        }
+        else if (retval)
+        {
+
+            if (setHas(&Chat->readable, Bio.pipefd[0]))
+                bioProcessCompleted();
+
+            /* If the listening socket is "readable", it actually means
+             * there are new clients connections pending to accept. We
+             * take them all, up to MAX_ACCEPTS_PER_CALL: one per
+             * iteration, a burst of connections would wait for as many
+             * polls of all the clients. */
+            for (int n = 0; Chat->serversock != -1 &&
+                            setHas(&Chat->readable, Chat->serversock) &&
+                            n < MAX_ACCEPTS_PER_CALL; n++)
+            {
+                uint32_t addr;
+                int fd = acceptClient(Chat->serversock, &addr);
+                if (fd == -1)
+                {
+                    if (errno == EMFILE || errno == ENFILE)
+                        shedConnection();
+                    break; // Or no more pending connections.
+                }
+                if (admitClient(addr))
+                    welcomeClient(fd, addr);
+                else
+                    refuseClient(fd);
+            }
+
+            /* Here for each connected client, check if there are pending
+             * data the client sent us, or if it is ready to receive the
+             * rest of its output. We don't always start from the lowest
+             * descriptor, or the clients with a low one would always be
+             * served first: every iteration starts one client later,
+             * wrapping around. */
+            int start = Chat->dispatchstart;
+            for (int pass = 0; pass < 2; pass++)
+            {
+                for (int j = setNext(active, pass ? 0 : start);
+                     j != -1 && (pass == 0 || j < start);
+                     j = setNext(active, j + 1))
+                {
+                    struct client *c = Chat->clients[j];
+                    if (setHas(&Chat->writable, j) && clientFlush(c) == -1)
+                    {
+                        c->flags |= CLIENT_CLOSE_ASAP;
+                        setAdd(&Chat->pendingwrite, j); // Freed before sleeping.
+                        continue;
+                    }
+                    if (setHas(&Chat->readable, j) &&
+                        !(c->flags & CLIENT_CLOSE_ASAP))
+                        readFromClient(c);
+                }
+            }
+            start = setNext(active, start + 1);
+            Chat->dispatchstart = start == -1 ? 0 : start;
+        }
+
+        /* Fire the timers that expired, no matter if we are idle or busy
+         * serving clients. */
+        timerProcess();
+
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+        Chat->stat_loops++;
+        Chat->stat_loop_cpu_us +=
+            (cpu_end.tv_sec - cpu_start.tv_sec) * 1000000LL +
+            (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1000;
     }
     return 0;
 }